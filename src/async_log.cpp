@@ -0,0 +1,301 @@
+#include "async_log.hpp"
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/date_time/posix_time/conversion.hpp>
+#include <boost/date_time/c_local_time_adjustor.hpp>
+#include <boost/log/sources/severity_logger.hpp>
+#include <boost/log/sources/record_ostream.hpp>
+#include <boost/log/attributes/mutable_constant.hpp>
+
+using namespace std;
+using namespace std::chrono;
+namespace logging = boost::log;
+
+//The staging queue of one thread. Only the thread writes head_, only the writer thread
+//writes tail_; a ring outlives its thread and is handed to the next new thread
+struct log_ring
+{
+	vector<async_log::slot> slots_;
+	atomic<size_t> head_{0};
+	atomic<size_t> tail_{0};
+	atomic<uint64_t> dropped_{0};
+	atomic<bool> busy_{false};//a record is being formatted into the ring
+	bool free_ = false;
+};
+
+//Formats into a slot, a record that doesn't fit is cut
+class slot_buf
+	: public streambuf
+{
+public:
+	void reset(char* begin, size_t len)
+	{
+		setp(begin, begin + len);
+	}
+
+	size_t size() const
+	{
+		return pptr() - pbase();
+	}
+};
+
+static vector<log_ring*> rings;
+static mutex rings_mutex;
+static size_t ring_size = 1024;
+
+static thread writer;
+static mutex writer_mutex;
+static condition_variable writer_cond;
+static atomic<bool> running(false);
+static bool stopping = false;
+
+atomic<int> async_log::level_(logging::trivial::trace);
+
+//Returns the ring to the free list when its thread exits
+struct log_ring_holder
+{
+	log_ring* ring_ = nullptr;
+
+	log_ring_holder()
+	{
+		lock_guard<mutex> lock(rings_mutex);
+		for (auto r : rings)
+		{
+			if (r->free_)
+			{
+				r->free_ = false;
+				ring_ = r;
+				return;
+			}
+		}
+		ring_ = new log_ring;
+		ring_->slots_.resize(ring_size);
+		rings.push_back(ring_);
+	}
+
+	~log_ring_holder()
+	{
+		lock_guard<mutex> lock(rings_mutex);
+		ring_->free_ = true;
+	}
+};
+
+static log_ring& local()
+{
+	static thread_local log_ring_holder holder;
+	return *holder.ring_;
+}
+
+//The stream a thread formats its records with, and whether a record of the thread holds it
+static thread_local slot_buf local_buf;
+static thread_local ostream local_stream(&local_buf);
+static thread_local bool formatting = false;
+
+void async_log::record::reserve(severity_level severity)
+{
+	//The thread's buffer holds a record already, this one gets a stream of its own
+	if (formatting)
+	{
+		severity_ = severity;
+		nested_ = new ostringstream;
+		return;
+	}
+
+	if (running.load(memory_order_acquire))
+	{
+		log_ring& ring = local();
+		//stop() turns running off before the writer waits for the busy rings, so either
+		//this record sees it off or the writer sees the ring busy
+		ring.busy_.store(true);
+		if (running.load())
+		{
+			size_t head = ring.head_.load(memory_order_relaxed);
+			if (head - ring.tail_.load(memory_order_acquire) >= ring.slots_.size())
+			{
+				ring.dropped_.store(ring.dropped_.load(memory_order_relaxed) + 1, memory_order_relaxed);
+				ring.busy_.store(false, memory_order_release);
+				return;
+			}
+			ring_ = &ring;
+			slot_ = &ring.slots_[head % ring.slots_.size()];
+		}
+		else
+		{
+			ring.busy_.store(false, memory_order_release);
+		}
+	}
+	if (!slot_)
+	{
+		static thread_local slot sync_slot;
+		slot_ = &sync_slot;
+	}
+	formatting = true;
+	slot_->severity_ = severity;
+	slot_->time_ = system_clock::now();
+	local_buf.reset(slot_->text_, max_text);
+}
+
+ostream& async_log::record::stream()
+{
+	ostream& out = nested_ ? static_cast<ostream&>(*nested_) : local_stream;
+	out.clear();
+	out.flags(ios_base::dec | ios_base::skipws);
+	out.precision(6);
+	out.fill(' ');
+	return out;
+}
+
+void async_log::record::commit()
+{
+	if (nested_)
+	{
+		string text = nested_->str();
+		BOOST_LOG_SEV(logging::trivial::logger::get(), severity_).write(text.data(), min(text.size(), max_text));
+		delete nested_;
+		nested_ = nullptr;
+		return;
+	}
+
+	slot_->len_ = local_buf.size();
+	formatting = false;
+
+	if (!ring_)
+	{
+		BOOST_LOG_SEV(logging::trivial::logger::get(), slot_->severity_).write(slot_->text_, slot_->len_);
+	}
+	else
+	{
+		ring_->head_.store(ring_->head_.load(memory_order_relaxed) + 1, memory_order_release);
+		ring_->busy_.store(false, memory_order_release);
+	}
+	slot_ = nullptr;
+}
+
+void async_log::record::abandon()
+{
+	delete nested_;
+	nested_ = nullptr;
+	if (slot_)
+	{
+		formatting = false;
+		if (ring_)
+			ring_->busy_.store(false, memory_order_release);
+		slot_ = nullptr;
+	}
+}
+
+void async_log::start(size_t size, severity_level level)
+{
+	level_.store(level, memory_order_relaxed);
+	ring_size = max<size_t>(size, 1);
+	stopping = false;
+	writer = thread(&async_log::run);
+	running.store(true, memory_order_release);
+}
+
+void async_log::stop()
+{
+	if (!writer.joinable())
+		return;
+
+	//Off first, a record reserved from now on is written synchronously
+	running.store(false);
+	{
+		lock_guard<mutex> lock(writer_mutex);
+		stopping = true;
+	}
+	writer_cond.notify_one();
+	writer.join();
+}
+
+uint64_t async_log::dropped()
+{
+	uint64_t dropped = 0;
+	lock_guard<mutex> lock(rings_mutex);
+	for (auto r : rings)
+		dropped += r->dropped_.load(memory_order_relaxed);
+	return dropped;
+}
+
+void async_log::run()
+{
+	uint64_t reported = 0;
+	for (;;)
+	{
+		size_t written = drain();
+
+		uint64_t lost = dropped();
+		if (lost != reported)
+		{
+			BOOST_LOG_TRIVIAL(warning) << lost - reported << " log records dropped, the log queue was full";
+			reported = lost;
+		}
+
+		unique_lock<mutex> lock(writer_mutex);
+		if (stopping)
+		{
+			lock.unlock();
+			//Records reserved by threads that saw running before it turned off
+			while (busy())
+			{
+				drain();
+				this_thread::yield();
+			}
+			drain();
+			return;
+		}
+		//An idle writer polls, a busy one goes straight on
+		if (written == 0)
+			writer_cond.wait_for(lock, milliseconds(5));
+	}
+}
+
+bool async_log::busy()
+{
+	lock_guard<mutex> lock(rings_mutex);
+	for (auto r : rings)
+	{
+		if (r->busy_.load())
+			return true;
+	}
+	return false;
+}
+
+size_t async_log::drain()
+{
+	static logging::sources::severity_logger<severity_level> logger;
+	static logging::attributes::mutable_constant<boost::posix_time::ptime> timestamp{boost::posix_time::ptime()};
+	static bool init = (logger.add_attribute("TimeStamp", timestamp), true);
+	(void)init;
+
+	vector<log_ring*> all;
+	{
+		lock_guard<mutex> lock(rings_mutex);
+		all = rings;
+	}
+
+	size_t written = 0;
+	for (auto ring : all)
+	{
+		size_t tail = ring->tail_.load(memory_order_relaxed);
+		size_t head = ring->head_.load(memory_order_acquire);
+		for (; tail != head; tail++)
+		{
+			const slot& s = ring->slots_[tail % ring->slots_.size()];
+
+			//The record keeps the time it was made, not the time it is written
+			auto us = duration_cast<microseconds>(s.time_.time_since_epoch()).count();
+			boost::posix_time::ptime utc = boost::posix_time::from_time_t(us / 1000000)
+				+ boost::posix_time::microseconds(us % 1000000);
+			timestamp.set(boost::date_time::c_local_adjustor<boost::posix_time::ptime>::utc_to_local(utc));
+
+			BOOST_LOG_SEV(logger, s.severity_).write(s.text_, s.len_);
+			written++;
+		}
+		ring->tail_.store(tail, memory_order_release);
+	}
+	return written;
+}
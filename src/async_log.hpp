@@ -0,0 +1,109 @@
+#ifndef ASYNC_LOG_HPP
+#define ASYNC_LOG_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <sstream>
+#include <streambuf>
+#include <boost/log/trivial.hpp>
+
+//Records below this severity are compiled out, -DAUTH_LOG_MIN_SEVERITY=2 drops trace and debug
+#ifndef AUTH_LOG_MIN_SEVERITY
+#define AUTH_LOG_MIN_SEVERITY 0
+#endif
+
+//AUTH_LOG(debug) << ...; goes through the async pipeline. Nothing is formatted for a
+//record whose severity is compiled out, below log_level, or when the thread's queue is full
+#define AUTH_LOG(lvl) \
+	for (async_log::record auth_log_record_(::boost::log::trivial::lvl, \
+			::boost::log::trivial::lvl >= AUTH_LOG_MIN_SEVERITY); \
+		auth_log_record_; auth_log_record_.commit()) \
+		auth_log_record_.stream()
+
+struct log_ring;
+
+//Logging off the hot path. A record is formatted straight into a slot of its thread's
+//staging ring, a lock-free single producer single consumer queue; one writer thread
+//drains the rings into the Boost.Log sinks of log.conf. A full ring drops the record
+//and counts it. Before start and after stop records are written synchronously, and so is
+//a record made while another one of its thread is formatted, an AUTH_LOG inside operator<<.
+class async_log
+{
+public:
+	typedef boost::log::trivial::severity_level severity_level;
+
+	//Longer records are cut
+	static const std::size_t max_text = 480;
+
+	struct slot
+	{
+		severity_level severity_;
+		std::chrono::system_clock::time_point time_;
+		std::size_t len_;
+		char text_[max_text];
+	};
+
+	class record
+	{
+	public:
+		//Inline so a record compiled out or below log_level costs a compare
+		record(severity_level severity, bool compiled)
+			: slot_(nullptr),
+			ring_(nullptr),
+			nested_(nullptr)
+		{
+			if (compiled && enabled(severity))
+				reserve(severity);
+		}
+
+		//A record left uncommitted by an exception while formatting is never published
+		~record()
+		{
+			if (slot_ || nested_)
+				abandon();
+		}
+
+		explicit operator bool() const { return slot_ != nullptr || nested_ != nullptr; }
+		std::ostream& stream();
+		void commit();
+
+		record(const record&) = delete;
+		record& operator=(const record&) = delete;
+
+	private:
+		void reserve(severity_level severity);
+		void abandon();
+
+		slot* slot_;
+		log_ring* ring_;//null when the slot is written synchronously
+		std::ostringstream* nested_;//set instead of slot_ for a nested record
+		severity_level severity_;
+	};
+
+	//Start the writer thread, ring_size slots per thread, records below level are skipped
+	static void start(std::size_t ring_size, severity_level level);
+
+	//Write what is queued and stop the writer thread. Records reserved before it are still
+	//written, later ones are written synchronously
+	static void stop();
+
+	//Records dropped because a ring was full
+	static uint64_t dropped();
+
+	static bool enabled(severity_level severity)
+	{
+		return severity >= level_.load(std::memory_order_relaxed);
+	}
+
+private:
+	static void run();
+	static std::size_t drain();
+	//A record is being formatted into some ring
+	static bool busy();
+
+	static std::atomic<int> level_;
+};
+
+#endif
@@ -28,12 +28,124 @@ bool auth_config::init_auth_environment(const string &config_file)
 
 			port_		= root.get<uint16_t>("port");
 			thread_cnt_ = root.get<uint16_t>("thread_cnt");
+			io_per_core_ = root.get<bool>("io_per_core", false);
+			cpu_affinity_ = root.get<bool>("cpu_affinity", false);
+			send_queue_max_ = root.get<uint32_t>("send_queue_max", 65536);
+			send_bytes_max_ = root.get<uint32_t>("send_bytes_max", 16777216);
+			recv_buffer_size_ = root.get<uint32_t>("recv_buffer_size", 16384);
+			recv_buffer_pool_ = root.get<uint32_t>("recv_buffer_pool", 64);
+			change_log_max_ = root.get<uint32_t>("change_log_max", 16384);
+			snapshot_max_age_ = root.get<uint32_t>("snapshot_max_age", 1);
+			group_reclaim_interval_ = root.get<uint32_t>("group_reclaim_interval", 60);
+			handshake_timeout_ = root.get<uint32_t>("handshake_timeout", 10);
+			heartbeat_interval_ = root.get<uint32_t>("heartbeat_interval", 30);
+			idle_timeout_ = root.get<uint32_t>("idle_timeout", 90);
+			tcp_keepalive_idle_ = root.get<uint32_t>("tcp_keepalive_idle", 60);
+			tcp_keepalive_interval_ = root.get<uint32_t>("tcp_keepalive_interval", 10);
+			tcp_keepalive_count_ = root.get<uint32_t>("tcp_keepalive_count", 5);
+			if (group_reclaim_interval_ == 0)
+			{
+				group_reclaim_interval_ = 1;
+			}
+
+			string policy = root.get<string>("overflow_policy", "drop_oldest");
+			if (policy == "drop_oldest")
+				overflow_policy_ = DROP_OLDEST;
+			else if (policy == "collapse")
+				overflow_policy_ = COLLAPSE_MAC;
+			else if (policy == "disconnect")
+				overflow_policy_ = DISCONNECT;
+			else
+				throw runtime_error("unknown overflow_policy " + policy);
 			server_pwd_ = root.get<string>("server_pwd");
+
+			string backend = root.get<string>("storage", "mysql");
+			if (backend == "mysql")
+				storage_ = STORAGE_MYSQL;
+			else if (backend == "local")
+				storage_ = STORAGE_LOCAL;
+			else if (backend == "null")
+				storage_ = STORAGE_NULL;
+			else
+				throw runtime_error("unknown storage " + backend);
+
 			db_server_  = root.get<string>("db_server");
 			db_user_	= root.get<string>("db_user");
 			db_pwd_		= root.get<string>("db_pwd");
 			db_database_ = root.get<string>("db_database");
 			db_table_	= root.get<string>("db_table");
+			db_writer_threads_ = root.get<uint16_t>("db_writer_threads", 2);
+			db_batch_max_ = root.get<uint32_t>("db_batch_max", 500);
+			db_flush_interval_ = root.get<uint32_t>("db_flush_interval", 100);
+			db_queue_max_ = root.get<uint32_t>("db_queue_max", 1048576);
+			db_pool_min_ = root.get<uint16_t>("db_pool_min", 1);
+			db_pool_max_ = root.get<uint16_t>("db_pool_max", db_writer_threads_ + 2);
+			db_acquire_timeout_ = root.get<uint32_t>("db_acquire_timeout", 1000);
+			db_check_interval_ = root.get<uint32_t>("db_check_interval", 30);
+			db_idle_timeout_ = root.get<uint32_t>("db_idle_timeout", 300);
+			db_load_threads_ = root.get<uint16_t>("db_load_threads", 4);
+			db_load_page_ = root.get<uint32_t>("db_load_page", 10000);
+			db_purge_batch_ = root.get<uint32_t>("db_purge_batch", 10000);
+			local_store_dir_ = root.get<string>("local_store_dir", "");
+			if (storage_ == STORAGE_LOCAL && local_store_dir_.empty())
+				throw runtime_error("the local storage needs local_store_dir");
+			journal_sync_interval_ = root.get<uint32_t>("journal_sync_interval", 10);
+			snapshot_interval_ = root.get<uint32_t>("snapshot_interval", 300);
+			peer_port_ = root.get<uint16_t>("peer_port", 0);
+			peers_.clear();
+			if (auto peers = root.get_child_optional("peers"))
+			{
+				for (auto& peer : *peers)
+					peers_.push_back(peer.second.get_value<string>());
+			}
+			anti_entropy_interval_ = root.get<uint32_t>("anti_entropy_interval", 30);
+			cluster_nodes_.clear();
+			if (auto cluster_nodes = root.get_child_optional("cluster_nodes"))
+			{
+				for (auto& node : *cluster_nodes)
+					cluster_nodes_.push_back(node.second.get_value<string>());
+			}
+			cluster_self_ = root.get<string>("cluster_self", "");
+			cluster_vnodes_ = root.get<uint32_t>("cluster_vnodes", 160);
+			metrics_port_ = root.get<uint16_t>("metrics_port", 0);
+			metrics_group_detail_ = root.get<bool>("metrics_group_detail", false);
+			trace_sample_rate_ = root.get<uint32_t>("trace_sample_rate", 0);
+			trace_ring_size_ = root.get<uint32_t>("trace_ring_size", 4096);
+
+			string level = root.get<string>("log_level", "trace");
+			severity_level severity;
+			if (!logging::trivial::from_string(level.c_str(), level.size(), severity))
+				throw runtime_error("unknown log_level " + level);
+			log_level_ = severity;
+			log_queue_size_ = root.get<uint32_t>("log_queue_size", 1024);
+			if (log_queue_size_ == 0)
+			{
+				log_queue_size_ = 1;
+			}
+			if (recv_buffer_size_ < 512)
+			{
+				recv_buffer_size_ = 512;
+			}
+			if (tcp_keepalive_interval_ == 0)
+			{
+				tcp_keepalive_interval_ = 1;
+			}
+			if (tcp_keepalive_count_ == 0)
+			{
+				tcp_keepalive_count_ = 1;
+			}
+			if (anti_entropy_interval_ == 0)
+			{
+				anti_entropy_interval_ = 1;
+			}
+			if (snapshot_interval_ == 0)
+			{
+				snapshot_interval_ = 1;
+			}
+			if (db_check_interval_ == 0)
+			{
+				db_check_interval_ = 1;
+			}
 
 			if (thread_cnt_ == 0)
 			{
@@ -2,8 +2,25 @@
 #define AUTH_CONFIG_HPP_
 
 #include <string>
+#include <vector>
 #include <boost/serialization/singleton.hpp>
 
+//What a connection does when its send queue overflows
+enum Overflow_Policy
+{
+	DROP_OLDEST,	//drop the oldest queued msg
+	COLLAPSE_MAC,	//keep only the latest queued msg of every mac
+	DISCONNECT		//close the connection, the client resyncs when it reconnects
+};
+
+//Where the groups are persisted
+enum Storage_Backend
+{
+	STORAGE_MYSQL,
+	STORAGE_LOCAL,	//journal and snapshot in local_store_dir
+	STORAGE_NULL	//nothing is kept
+};
+
 struct auth_config 
 {
 	bool init_auth_environment(const std::string &config_file);
@@ -11,13 +28,65 @@ struct auth_config
 
 	uint16_t port_;       //socket listen port
 	uint16_t thread_cnt_;
+	bool io_per_core_;    //every thread runs its own io_service and acceptor
+	bool cpu_affinity_;   //pin every io thread to a cpu
+	uint32_t send_queue_max_; //max frames waiting in a connection's send queue
+	uint32_t send_bytes_max_; //max bytes queued or in flight on a connection
+	uint32_t recv_buffer_size_; //bytes of a pooled receive block, one read fills it with many frames
+	uint32_t recv_buffer_pool_; //free receive blocks a thread keeps for reuse
+	Overflow_Policy overflow_policy_;
+	uint32_t change_log_max_; //changes a group remembers for delta resync
+	uint32_t snapshot_max_age_; //seconds a pre-encoded group snapshot is reused by joiners
+	uint32_t group_reclaim_interval_; //seconds between scans for empty groups to free
+	uint32_t handshake_timeout_;  //seconds a client has to get certified, 0 waits forever
+	uint32_t heartbeat_interval_; //seconds a CAP_HEARTBEAT client may be silent before it is pinged, 0 never pings
+	uint32_t idle_timeout_;       //seconds a client may be silent before it is closed, 0 never closes. Without
+	                              //CAP_HEARTBEAT its acks count, keep tcp_keepalive_idle below this
+	uint32_t tcp_keepalive_idle_; //seconds before the kernel probes an idle socket, 0 leaves keepalive off
+	uint32_t tcp_keepalive_interval_; //seconds between keepalive probes
+	uint32_t tcp_keepalive_count_;    //unanswered probes before the kernel drops the socket
 
 	std::string server_pwd_;//The cipher of the MD5 algorithm
 
+	Storage_Backend storage_;
+
 	std::string db_server_;
 	std::string db_user_;
 	std::string db_pwd_;
 	std::string db_database_;
 	std::string db_table_;
+	uint16_t db_writer_threads_; //threads writing the queued records to the database
+	uint32_t db_batch_max_;      //max records in one database write
+	uint32_t db_flush_interval_; //milliseconds a queued record waits for a fuller batch
+	uint32_t db_queue_max_;      //max records waiting to be written
+	uint16_t db_pool_min_;       //connections the pool keeps open
+	uint16_t db_pool_max_;
+	uint32_t db_acquire_timeout_; //milliseconds to wait for a free connection
+	uint32_t db_check_interval_;  //seconds between health checks of the idle connections
+	uint32_t db_idle_timeout_;    //seconds a connection above db_pool_min stays idle before it is closed
+	uint16_t db_load_threads_;    //gid partitions loaded in parallel at startup
+	uint32_t db_load_page_;       //rows read in one page of the startup load
+	uint32_t db_purge_batch_;     //expired rows deleted by one statement at startup
+
+	std::string local_store_dir_; //journal and snapshot directory, empty disables the local store
+	uint32_t journal_sync_interval_; //milliseconds between journal fdatasyncs
+	uint32_t snapshot_interval_;  //seconds between local snapshots
+
+	uint16_t peer_port_;          //port the peers dial, 0 accepts no peers
+	std::vector<std::string> peers_; //"host:port" of the peers this server replicates to
+	uint32_t anti_entropy_interval_; //seconds between anti-entropy rounds
+
+	std::vector<std::string> cluster_nodes_; //"host:port" of every cluster node, empty disables cluster mode
+	std::string cluster_self_;    //the cluster node this server serves
+	uint32_t cluster_vnodes_;     //ring points per cluster node
+
+	uint16_t metrics_port_;       //port of the Prometheus endpoint, 0 disables it
+	bool metrics_group_detail_;   //a records gauge per gid, one series per group
+
+	uint32_t trace_sample_rate_;  //trace one in that many auth msgs, 0 disables tracing
+	uint32_t trace_ring_size_;    //finished traces kept per thread
+
+	uint8_t log_level_;           //records below this boost::log::trivial severity are skipped before formatting
+	uint32_t log_queue_size_;     //log records a thread can stage for the log writer
 };
 #endif
@@ -1,73 +1,484 @@
+#include <algorithm>
+#include <random>
+#include <tuple>
+#include <unordered_set>
 #include "auth_group.hpp"
-#include <boost/log/trivial.hpp>
+#include "auth_config.hpp"
+#include "metrics.hpp"
+#include "msg_trace.hpp"
+#include "async_log.hpp"
 using namespace std;
 
-void auth_group::join(connection_ptr participant)
+//Encode the records once per encoding the participants ask for
+class fanout_frames
 {
-	lock_guard<mutex> lock(mutex_);
+public:
+	explicit fanout_frames(const vector<auth_info>& auths)
+		: auths_(auths)
+	{
+	}
+
+	frame_list_ptr get(const connection& participant)
+	{
+		bool batch = participant.accepts_batch() && auths_.size() > 1;
+		frame_list_ptr& frames = frames_[participant.wire_version()][batch];
+		if (!frames)
+		{
+			frames = auth_message::construct_auth_frames(auths_, participant.wire_version(), batch);
+			//The frames of a traced msg carry the trace to the participants
+			if (msg_trace* trace = msg_trace::current())
+			{
+				auto traced = make_shared<vector<keyed_frame> >(*frames);
+				for (auto& frame : *traced)
+					frame.trace_ = trace->shared_from_this();
+				frames = traced;
+			}
+		}
+		return frames;
+	}
+
+private:
+	const vector<auth_info>& auths_;
+	frame_list_ptr frames_[MSG_VERSION_NR][2];
+};
+
+//All groups of this run share the same sequence base. The epoch is random per boot,
+//so a client of another server started in the same second can't take a delta from this one
+static uint64_t seq_base()
+{
+	static const uint64_t base = static_cast<uint64_t>(static_cast<uint32_t>(time(NULL)) ^ random_device()()) << 32;
+	return base;
+}
+
+auth_group::auth_group(unsigned gid, expiry_wheel& wheel)
+	: gid_(gid),
+	wheel_(wheel),
+	seq_(seq_base())
+{
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+	change_log_max_ = config.change_log_max_;
+	snapshot_max_age_ = config.snapshot_max_age_;
+	fill(chunk_seq_, chunk_seq_ + snapshot_chunks, seq_);
+	fill(chunk_digest_, chunk_digest_ + digest_chunks, 0);
+}
+
+bool auth_group::join(connection_ptr participant, uint64_t last_seq)
+{
+	timed_unique_lock lock(mutex_);
+	if (retired_)
+		return false;
+
+	vector<auth_info> auths;
+	if (last_seq != 0 && collect_delta(last_seq, auths))
+	{
+		if (!auths.empty())
+			participant->deliver(fanout_frames(auths).get(*participant));
+		participants_.insert(participant);
+
+		AUTH_LOG(info) << "client " << participant->to_string() << " join group, delta " << auths.size() << " records";
+		return true;
+	}
+	lock.unlock();
+
+	snapshot_ptr snap = get_snapshot(participant->wire_version(), participant->accepts_batch());
+
+	//Queue the snapshot, then the changes made since it was built, then join the live fanout
+	lock.lock();
+	if (retired_)
+		return false;
+	for (auto& chunk : snap->chunks_)
+	{
+		if (!chunk.frames_->empty())
+			participant->deliver(chunk.frames_);
+	}
+
+	if (!collect_delta(snap->version_, auths))
+	{
+		auths.clear();
+		collect_all(auths);
+	}
+	if (!auths.empty())
+		participant->deliver(fanout_frames(auths).get(*participant));
 
 	participants_.insert(participant);
 
-	for(auto it = recent_auth_.begin();it!= recent_auth_.end();)
-    {
-		if (time(NULL) - it->second.auth_time_ >= it->second.duration_)
+	AUTH_LOG(info) << "client "<<  participant->to_string() << " join group, snapshot version " << snap->version_;
+	return true;
+}
+
+auth_group::snapshot_ptr auth_group::get_snapshot(uint8_t version, bool batch)
+{
+	lock_guard<mutex> build_lock(build_mutex_);
+
+	time_t now = time(NULL);
+	snapshot_ptr current;
+	auto snap = make_shared<snapshot>();
+	vector<vector<auth_info> > records(snapshot_chunks);
+	vector<bool> stale(snapshot_chunks, true);
+
+	//Copy the records of the stale chunks under the group lock
+	{
+		timed_lock_guard lock(mutex_);
+
+		current = snapshots_[version][batch];
+		if (fresh(current, now) && current->version_ == seq_)
+			return current;
+
+		for (size_t i = 0; current && i < snapshot_chunks; i++)
+		{
+			const snapshot_chunk& chunk = current->chunks_[i];
+			stale[i] = chunk_seq_[i] > chunk.version_ || now - chunk.built_ >= snapshot_max_age_;
+		}
+
+		recent_auth_.for_each([&](const auth_record& record)
 		{
-			it = recent_auth_.erase(it);
-		} 
+			size_t i = chunk_of(record.mac());
+			if (stale[i] && !record.expired(now))
+				records[i].push_back(record.to_auth_info());
+		});
+		snap->version_ = seq_;
+	}
+
+	//Encode them without blocking insert
+	snap->oldest_built_ = now;
+	snap->chunks_.resize(snapshot_chunks);
+	for (size_t i = 0; i < snapshot_chunks; i++)
+	{
+		if (stale[i])
+		{
+			snap->chunks_[i].version_ = snap->version_;
+			snap->chunks_[i].built_ = now;
+			snap->chunks_[i].frames_ = auth_message::construct_auth_frames(records[i], version, batch);
+		}
 		else
 		{
-			participant->deliver((it++)->second);
+			snap->chunks_[i] = current->chunks_[i];
+			snap->oldest_built_ = min(snap->oldest_built_, snap->chunks_[i].built_);
+		}
+	}
+
+	timed_lock_guard lock(mutex_);
+	snapshots_[version][batch] = snap;
+	return snap;
+}
+
+//Remaining durations are encoded into the frames, so a snapshot is only reused for a while
+bool auth_group::fresh(const snapshot_ptr& snap, time_t now) const
+{
+	return snap && now - snap->oldest_built_ < snapshot_max_age_;
+}
+
+//The low bits of a mac are the device specific part
+size_t auth_group::chunk_of(uint64_t mac)
+{
+	return mac % snapshot_chunks;
+}
+
+bool auth_group::collect_delta(uint64_t last_seq, vector<auth_info>& auths)
+{
+	//The log must hold every change after last_seq
+	if (last_seq > seq_)
+		return false;
+	if (last_seq < seq_ && (change_log_.empty() || change_log_.front().first > last_seq + 1))
+		return false;
+
+	auto it = lower_bound(change_log_.begin(), change_log_.end(), make_pair(last_seq + 1, uint64_t(0)));
+
+	unordered_set<uint64_t> macs;
+	time_t now = time(NULL);
+	for (; it != change_log_.end(); ++it)
+	{
+		if (!macs.insert(it->second).second)
+			continue;
+
+		//There are no erase msgs, a client only drops an erased or expired mac with a snapshot
+		const auth_record* record = recent_auth_.find(it->second);
+		if (!record || record->expired(now))
+		{
+			auths.clear();
+			return false;
 		}
-     }
+		auths.push_back(record->to_auth_info());
+	}
+	return true;
+}
 
-	BOOST_LOG_TRIVIAL(info) << "client "<<  participant->to_string() << " join group";
+void auth_group::collect_all(vector<auth_info>& auths)
+{
+	time_t now = time(NULL);
+	auths.reserve(recent_auth_.size());
+	recent_auth_.for_each([&auths, now](const auth_record& record)
+	{
+		if (!record.expired(now))
+			auths.push_back(record.to_auth_info());
+	});
+}
+
+void auth_group::log_change(auth_info& auth)
+{
+	log_change(auth_message::mac_key(auth.mac_) & mac_mask);
+	auth.seq_ = seq_;
+}
+
+void auth_group::log_change(uint64_t mac)
+{
+	++seq_;
+	chunk_seq_[chunk_of(mac)] = seq_;
+	change_log_.push_back(make_pair(seq_, mac));
+	if (change_log_.size() > change_log_max_)
+		change_log_.pop_front();
 }
 
 void auth_group::leave(connection_ptr participant)
 {
-	lock_guard<mutex> lock(mutex_);
+	timed_lock_guard lock(mutex_);
 	participants_.erase(participant);
 
-	BOOST_LOG_TRIVIAL(info) << "client " << participant->to_string() << " leave group";
+	AUTH_LOG(info) << "client " << participant->to_string() << " leave group";
 }
 
-void auth_group::insert(const auth_info& auth)
+bool auth_group::insert(const auth_info& auth)
 {
-	lock_guard<mutex> lock(mutex_);
+	timed_lock_guard lock(mutex_);
+	if (retired_)
+		return false;
+	if (msg_trace* trace = msg_trace::current())
+		trace->mark(TRACE_LOCKED);
 
-	recent_auth_[auth.mac_] = auth;
+	vector<auth_info> auths(1, auth);
+	store(auths[0]);
 
+	metrics::observe(FANOUT_SIZE, participants_.size());
+	fanout_frames frames(auths);
 	for (auto participant : participants_)
-		participant->deliver(auth);
+		participant->deliver(frames.get(*participant));
 
-	BOOST_LOG_TRIVIAL(debug) << "group recv new auth:mac is" << auth.mac_ 
+	AUTH_LOG(debug) << "group recv new auth:mac is" << auth.mac_ 
 		<< ",attr is " << auth.attr_ << ",duration is" << auth.duration_;
+	return true;
 }
 
-void auth_group::erase(const auth_info &auth)
+bool auth_group::insert(vector<auth_info> auths)
 {
-	lock_guard<mutex> lock(mutex_);
+	timed_lock_guard lock(mutex_);
+	if (retired_)
+		return false;
+	if (msg_trace* trace = msg_trace::current())
+		trace->mark(TRACE_LOCKED);
 
-	if (recent_auth_.count(auth.mac_))
+	for (auto& auth : auths)
+		store(auth);
+
+	metrics::observe(FANOUT_SIZE, participants_.size());
+	fanout_frames frames(auths);
+	for (auto participant : participants_)
+		participant->deliver(frames.get(*participant));
+
+	AUTH_LOG(debug) << "group recv " << auths.size() << " new auths";
+	return true;
+}
+
+bool auth_group::load(vector<auth_info>& auths)
+{
+	timed_lock_guard lock(mutex_);
+	if (retired_)
+		return false;
+
+	for (auto& auth : auths)
 	{
-		recent_auth_.erase(auth.mac_);
+		//Key 0 would make every unparsable mac one record
+		if (auth_message::mac_key(auth.mac_) == 0)
+		{
+			metrics::add(INVALID_MACS);
+			continue;
+		}
+		store(auth);
 	}
+	return true;
 }
 
-bool auth_group::authed(auth_info &auth)
+bool auth_group::merge(vector<auth_info>& auths)
 {
-	lock_guard<mutex> lock(mutex_);
+	timed_lock_guard lock(mutex_);
+	if (retired_)
+		return false;
 
-	if (recent_auth_.count(auth.mac_))
+	time_t now = time(NULL);
+	vector<auth_info> stored;
+	for (auto& auth : auths)
 	{
-		auth = recent_auth_[auth.mac_];
-
-		if (time(NULL) - auth.auth_time_ >= auth.duration_)
+		if (auth.auth_time_ + auth.duration_ <= now)
+			continue;
+		uint64_t key = auth_message::mac_key(auth.mac_);
+		if (key == 0)
 		{
-			recent_auth_.erase(auth.mac_);
-			return false;
+			metrics::add(INVALID_MACS);
+			continue;
 		}
+		const auth_record* record = recent_auth_.find(key & mac_mask);
+		if (record && !newer(auth, *record))
+			continue;
+		store(auth);
+		stored.push_back(auth);
+	}
+	auths.swap(stored);
+
+	if (auths.empty() || participants_.empty())
 		return true;
+
+	metrics::observe(FANOUT_SIZE, participants_.size());
+	fanout_frames frames(auths);
+	for (auto participant : participants_)
+		participant->deliver(frames.get(*participant));
+	return true;
+}
+
+bool auth_group::newer(const auth_info& auth, const auth_record& record)
+{
+	return make_tuple(auth.auth_time_, auth.duration_, auth.attr_, auth.res1_, auth.res2_)
+		> make_tuple(record.auth_time_, record.duration_, record.attr(), record.res1_, record.res2_);
+}
+
+uint64_t auth_group::digest_of(const auth_record& record)
+{
+	//MurmurHash3 fmix64 over the fields, the sequence is local and left out
+	uint64_t h = record.mac_attr_;
+	for (uint64_t v : { uint64_t(record.duration_) << 32 | record.auth_time_, uint64_t(record.res1_) << 32 | record.res2_ })
+	{
+		h ^= v + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDull;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ull;
+		h ^= h >> 33;
+	}
+	return h;
+}
+
+uint64_t auth_group::digest()
+{
+	uint64_t digests[digest_chunks];
+	chunk_digests(digests);
+
+	uint64_t h = 0;
+	for (auto d : digests)
+	{
+		h = (h ^ d) * 0x100000001B3ull;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+void auth_group::chunk_digests(uint64_t digests[digest_chunks])
+{
+	timed_lock_guard lock(mutex_);
+	copy(chunk_digest_, chunk_digest_ + digest_chunks, digests);
+}
+
+void auth_group::chunk_records(uint64_t chunk_mask, vector<auth_info>& auths)
+{
+	timed_lock_guard lock(mutex_);
+
+	time_t now = time(NULL);
+	recent_auth_.for_each([&auths, chunk_mask, now](const auth_record& record)
+	{
+		if ((chunk_mask >> (record.mac() % digest_chunks)) & 1 && !record.expired(now))
+			auths.push_back(record.to_auth_info());
+	});
+}
+
+void auth_group::records(vector<auth_info>& auths)
+{
+	timed_lock_guard lock(mutex_);
+	collect_all(auths);
+}
+
+size_t auth_group::size()
+{
+	timed_lock_guard lock(mutex_);
+	return recent_auth_.size();
+}
+
+size_t auth_group::participants()
+{
+	timed_lock_guard lock(mutex_);
+	return participants_.size();
+}
+
+void auth_group::store(auth_info& auth)
+{
+	log_change(auth);
+
+	auth_record record;
+	record.from_auth_info(auth);
+	const auth_record* old = recent_auth_.find(record.mac());
+	if (old)
+		unstore(*old);
+	recent_auth_.insert(record);
+	chunk_digest_[record.mac() % digest_chunks] ^= digest_of(record);
+
+	wheel_.add(expiry_entry{ gid_, record.auth_time_ + record.duration_, record.mac() });
+}
+
+void auth_group::expire(const vector<expiry_entry>& entries, const erase_handler& erased)
+{
+	vector<uint64_t> macs;
+	timed_lock_guard lock(mutex_);
+
+	time_t now = time(NULL);
+	for (auto& entry : entries)
+	{
+		//A record refreshed since the entry was added has a later entry of its own
+		const auth_record* record = recent_auth_.find(entry.mac_);
+		if (record && record->auth_time_ + record->duration_ == entry.expire_at_ && record->expired(now))
+		{
+			unstore(*record);
+			recent_auth_.erase(entry.mac_);
+			log_change(entry.mac_);
+			macs.push_back(entry.mac_);
+		}
+	}
+	if (!macs.empty())
+		erased(macs);
+}
+
+void auth_group::erase(const auth_info &auth)
+{
+	timed_lock_guard lock(mutex_);
+
+	uint64_t mac = auth_message::mac_key(auth.mac_) & mac_mask;
+	const auth_record* record = recent_auth_.find(mac);
+	if (record)
+	{
+		unstore(*record);
+		recent_auth_.erase(mac);
+		log_change(mac);
 	}
-	return false;
-}
\ No newline at end of file
+}
+
+void auth_group::unstore(const auth_record& record)
+{
+	chunk_digest_[record.mac() % digest_chunks] ^= digest_of(record);
+}
+
+bool auth_group::retire()
+{
+	timed_lock_guard lock(mutex_);
+
+	if (participants_.empty() && recent_auth_.size() == 0)
+		retired_ = true;
+	return retired_;
+}
+
+bool auth_group::authed(auth_info &auth)
+{
+	timed_lock_guard lock(mutex_);
+
+	uint64_t mac = auth_message::mac_key(auth.mac_) & mac_mask;
+	const auth_record* record = recent_auth_.find(mac);
+	if (!record || record->expired(time(NULL)))
+		return false;
+
+	auth = record->to_auth_info();
+	return true;
+}
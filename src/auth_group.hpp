@@ -1,8 +1,13 @@
 #include <set>
 #include <map>
+#include <deque>
+#include <vector>
 #include <mutex>
+#include <functional>
 #include <boost/asio.hpp>
 #include "auth_message.hpp"
+#include "mac_table.hpp"
+#include "expiry_wheel.hpp"
 #include "connection.hpp"
 
 using boost::asio::ip::tcp;
@@ -10,18 +15,124 @@ using boost::asio::ip::tcp;
 class auth_group
 {
 public:
-	void join(connection_ptr participant);
+	auth_group(unsigned gid, expiry_wheel& wheel);
+
+	//Replay the changes after last_seq, or the group snapshot when the change log no longer covers them.
+	//False if the group was reclaimed meanwhile, look it up again.
+	bool join(connection_ptr participant, uint64_t last_seq = 0);
 
 	void leave(connection_ptr participant);
 
-	void insert(const auth_info& auth);
+	//The writers return false, storing nothing, if the group was reclaimed meanwhile, look it up again
+	bool insert(const auth_info& auth);
+
+	bool insert(std::vector<auth_info> auths);
+
+	//Bulk insert of records restored from the local store, nobody is told
+	bool load(std::vector<auth_info>& auths);
+
+	//Bulk insert of records loaded from the database or replicated by a peer. Last writer wins:
+	//a record only replaces an older one, expired records are skipped. The participants get
+	//what was stored, and auths is left holding just that
+	bool merge(std::vector<auth_info>& auths);
+
+	//The live records
+	void records(std::vector<auth_info>& auths);
+
+	//Records stored, expired ones included until the wheel evicts them, and participants
+	std::size_t size();
+	std::size_t participants();
+
+	//Anti-entropy digests: every chunk of the records XORs the hashes of its records,
+	//the group digest hashes the chunk digests. Equal records give equal digests
+	static const std::size_t digest_chunks = 64;
+	uint64_t digest();
+	void chunk_digests(uint64_t digests[digest_chunks]);
+
+	//The live records of the chunks whose bit is set in chunk_mask
+	void chunk_records(uint64_t chunk_mask, std::vector<auth_info>& auths);
 
 	void erase(const auth_info &auth);
 
 	bool authed(auth_info &auth);
 
+	//Erase the entries whose record still expires at that time. erased gets their macs with the
+	//lock still held, so the deletes it queues go ahead of any put of a later auth of the macs
+	typedef std::function<void(const std::vector<uint64_t>&)> erase_handler;
+	void expire(const std::vector<expiry_entry>& entries, const erase_handler& erased);
+
+	//Mark an empty group as retired so nobody joins it any more, false if it isn't empty
+	bool retire();
+
 private:
-	std::map<std::string, auth_info> recent_auth_;
+	//Stamp the record with the next sequence and log the change
+	void log_change(auth_info& auth);
+	void log_change(uint64_t mac);
+
+	//Stamp and store the record
+	void store(auth_info& auth);
+
+	//Remove a stored record from its chunk digest
+	void unstore(const auth_record& record);
+
+	static uint64_t digest_of(const auth_record& record);
+
+	//Last writer wins by auth_time_, the other fields break ties so every node picks the same record
+	static bool newer(const auth_info& auth, const auth_record& record);
+
+	//Live records changed after last_seq, false if the change log doesn't reach back that far
+	//or a mac was erased or expired since, which only a snapshot removes from the client
+	bool collect_delta(uint64_t last_seq, std::vector<auth_info>& auths);
+	void collect_all(std::vector<auth_info>& auths);
+
+	//The group pre-encoded for one encoding, shared by concurrent joiners. The records are
+	//split into chunks by mac so a rebuild only encodes the chunks changed since the last one
+	struct snapshot_chunk
+	{
+		uint64_t version_;	//group sequence when the chunk was encoded
+		time_t built_;
+		frame_list_ptr frames_;
+	};
+	struct snapshot
+	{
+		uint64_t version_;
+		time_t oldest_built_;
+		std::vector<snapshot_chunk> chunks_;
+	};
+	typedef std::shared_ptr<const snapshot> snapshot_ptr;
+
+	static const std::size_t snapshot_chunks = 64;
+	static std::size_t chunk_of(uint64_t mac);
+
+	//Return a snapshot not older than snapshot_max_age_, rebuilt outside the group lock when needed
+	snapshot_ptr get_snapshot(uint8_t version, bool batch);
+	bool fresh(const snapshot_ptr& snap, time_t now) const;
+
+	unsigned gid_;
+	mac_table recent_auth_;
+
+	//Evicts the records when they expire
+	expiry_wheel& wheel_;
+
+	//Sequence of the last change. It starts at the startup time << 32,
+	//so the sequences of a previous run are always older than the change log
+	uint64_t seq_;
+
+	//The recent changes in sequence order, bounded by change_log_max_
+	std::deque<std::pair<uint64_t, uint64_t> > change_log_;
+	std::size_t change_log_max_;
+
+	//Sequence of the last change of every snapshot chunk
+	uint64_t chunk_seq_[snapshot_chunks];
+
+	uint64_t chunk_digest_[digest_chunks];
+
+	//Snapshots by wire version and batch, rebuilt by one joiner at a time
+	snapshot_ptr snapshots_[MSG_VERSION_NR][2];
+	time_t snapshot_max_age_;
+	std::mutex build_mutex_;
+
 	std::set<connection_ptr> participants_;
+	bool retired_ = false;
 	std::mutex mutex_;
 };
\ No newline at end of file
@@ -1,12 +1,16 @@
 #include "auth_message.hpp"
 #include "auth_config.hpp"
 #include <algorithm>
+#include <cstring>
 #include <stdexcept>
 #include <random>
 #include <sstream>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include "md5.hpp"
+#include "byte_order.hpp"
+#include "metrics.hpp"
+#include "async_log.hpp"
 
 using namespace std;
 using boost::serialization::singleton;
@@ -19,13 +23,25 @@ using boost::asio::detail::socket_ops::network_to_host_short;
 //The head must be set before sending
 void auth_message::set_header(Msg_Type type)
 {
-	header_.version_ = 1;
+	header_.version_ = MSG_VERSION_JSON;
 	header_.type_ = type;
 	header_.len_ = host_to_network_short(send_body_.size());
 	header_.res1_ = 0;
 	header_.res2_ = 0;
 }
 
+//Fill the header reserved at the front of a frame
+void auth_message::put_header(string& frame, Msg_Type type, size_t body_len, uint8_t version)
+{
+	header head;
+	head.version_ = version;
+	head.type_ = type;
+	head.len_ = host_to_network_short(body_len);
+	head.res1_ = 0;
+	head.res2_ = 0;
+	memcpy(&frame[0], &head, sizeof(head));
+}
+
 //Parsing the header information received from the client
 void auth_message::parse_header()
 {
@@ -33,7 +49,7 @@ void auth_message::parse_header()
 	header_.res1_ = network_to_host_short(header_.res1_);
 	header_.res2_ = network_to_host_short(header_.res2_);
 
-	if (header_.version_ != 1 || header_.len_ == 0)
+	if (header_.version_ < MSG_VERSION_JSON || header_.version_ >= MSG_VERSION_NR || header_.len_ == 0)
 	{
 		throw runtime_error("header invalid");
 	}
@@ -41,8 +57,13 @@ void auth_message::parse_header()
 	{
 		throw runtime_error("header type invalid");
 	}
+}
 
-	recv_body_.resize(header_.len_);//Adjust the size, be ready to accept the message body
+//The body is parsed in place, it must stay valid until the frame is handled
+void auth_message::set_body(const char* data, size_t len)
+{
+	body_ = data;
+	body_len_ = len;
 }
 
 //Verify the validity of the client
@@ -72,14 +93,31 @@ void auth_message::parse_check_client_res_msg()
 {
 	const auth_config& config = singleton<auth_config>::get_const_instance();
 
-	ptree root;
-	istringstream input(string(recv_body_.begin(), recv_body_.end()));
-	read_json(input, root);
-
 	chap client_chap;
-	client_chap.gid_ = root.get<uint32_t>("gid_");
-	client_chap.res1_ = root.get<uint32_t>("res1_");
-	client_chap.chap_str_ = base16_to_string(root.get<string>("chap_str_"));
+	if (header_.version_ == MSG_VERSION_BINARY)
+	{
+		//gid[4] res1[4] chap[16] and the optional last_seq[8]
+		if (body_len_ < 24)
+		{
+			throw runtime_error("chap msg length error");
+		}
+		client_chap.gid_ = get_uint32(body_);
+		client_chap.res1_ = get_uint32(body_ + 4);
+		client_chap.chap_str_.assign(body_ + 8, 16);
+		if (body_len_ >= 32)
+			client_chap.last_seq_ = get_uint64(body_ + 24);
+	}
+	else
+	{
+		ptree root;
+		istringstream input(string(body_, body_len_));
+		read_json(input, root);
+
+		client_chap.gid_ = root.get<uint32_t>("gid_");
+		client_chap.res1_ = root.get<uint32_t>("res1_");
+		client_chap.chap_str_ = base16_to_string(root.get<string>("chap_str_"));
+		client_chap.last_seq_ = root.get<uint64_t>("last_seq_", 0);
+	}
 
 	if (client_chap.chap_str_.size() != 16)
 	{
@@ -98,43 +136,428 @@ void auth_message::parse_check_client_res_msg()
 	}
 
 	server_chap_.gid_ = client_chap.gid_;
+	server_chap_.res1_ = client_chap.res1_;
+	server_chap_.last_seq_ = client_chap.last_seq_;
+
+	//A binary CHECK_CLIENT_RESPONSE or the capability bit asks for binary msgs
+	if (header_.version_ == MSG_VERSION_BINARY || (client_chap.res1_ & CAP_BINARY))
+	{
+		wire_version_ = MSG_VERSION_BINARY;
+	}
+}
+
+uint8_t auth_message::wire_version() const
+{
+	return wire_version_;
+}
+
+uint64_t auth_message::last_seq() const
+{
+	return server_chap_.last_seq_;
+}
+
+bool auth_message::has_capability(Capability cap) const
+{
+	return (server_chap_.res1_ & cap) != 0;
+}
+
+void auth_message::trim()
+{
+	if (!send_body_.empty())
+	{
+		string().swap(send_body_);
+		vector<boost::asio::const_buffer>().swap(send_buffers_);
+	}
+	if (recv_body_.capacity() > 0)
+		vector<char>().swap(recv_body_);
 }
 
 //Sending the authentication information to the client
-void auth_message::constuct_auth_res_msg(const auth_info& auth)
+frame_ptr auth_message::construct_auth_res_frame(const auth_info& auth, uint8_t version)
+{
+	auto frame = make_shared<string>(sizeof(header), 0);
+
+	if (version == MSG_VERSION_BINARY)
+	{
+		put_auth_record(*frame, auth, remaining_duration(auth));
+	}
+	else
+	{
+		ptree root;
+		stringstream output;
+		put_auth_json(root, auth, remaining_duration(auth));
+
+		write_json(output, root);
+		frame->append(output.str());
+	}
+
+	put_header(*frame, AUTH_RESPONSE, frame->size() - sizeof(header), version);
+	return frame;
+}
+
+//Pack the records into as few AUTH_BATCH frames as header::len_ allows
+vector<frame_ptr> auth_message::construct_auth_batch_frames(const vector<auth_info>& auths, uint8_t version)
+{
+	vector<frame_ptr> frames;
+	shared_ptr<string> frame;
+	uint16_t count = 0;
+	string record;
+
+	auto finish = [&]()
+	{
+		if (version == MSG_VERSION_BINARY)
+		{
+			(*frame)[sizeof(header)] = static_cast<char>(count >> 8);
+			(*frame)[sizeof(header) + 1] = static_cast<char>(count & 0xff);
+		}
+		else
+		{
+			frame->append("]}");
+		}
+		put_header(*frame, AUTH_BATCH, frame->size() - sizeof(header), version);
+		frames.push_back(frame);
+		frame.reset();
+	};
+
+	for (auto& auth : auths)
+	{
+		record.clear();
+		if (version == MSG_VERSION_BINARY)
+		{
+			put_auth_record(record, auth, remaining_duration(auth));
+		}
+		else
+		{
+			ptree root;
+			stringstream output;
+			put_auth_json(root, auth, remaining_duration(auth));
+			write_json(output, root, false);
+			record = output.str();
+			record.erase(record.find_last_not_of('\n') + 1);
+		}
+
+		//json needs a separator and the closing "]}"
+		if (frame && frame->size() - sizeof(header) + record.size() + 3 > max_body_len)
+			finish();
+
+		if (!frame)
+		{
+			frame = make_shared<string>(sizeof(header), 0);
+			if (version == MSG_VERSION_BINARY)
+				put_uint16(*frame, 0);//count, set by finish()
+			else
+				frame->append("{\"auths_\":[");
+			count = 0;
+		}
+		else if (version != MSG_VERSION_BINARY)
+		{
+			frame->push_back(',');
+		}
+
+		frame->append(record);
+		count++;
+	}
+
+	if (frame)
+		finish();
+
+	return frames;
+}
+
+frame_list_ptr auth_message::construct_auth_frames(const vector<auth_info>& auths, uint8_t version, bool batch)
+{
+	auto frames = make_shared<vector<keyed_frame> >();
+
+	if (batch && auths.size() > 1)
+	{
+		for (auto& frame : construct_auth_batch_frames(auths, version))
+			frames->push_back(keyed_frame{ frame, 0 });
+	}
+	else
+	{
+		frames->reserve(auths.size());
+		for (auto& auth : auths)
+			frames->push_back(keyed_frame{ construct_auth_res_frame(auth, version), mac_key(auth.mac_) });
+	}
+	return frames;
+}
+
+//Send a client to the server that owns its gid
+frame_ptr auth_message::construct_redirect_frame(const string& host, uint16_t port, uint8_t version)
+{
+	auto frame = make_shared<string>(sizeof(header), 0);
+
+	if (version == MSG_VERSION_BINARY)
+	{
+		put_uint16(*frame, port);
+		frame->append(host);
+	}
+	else
+	{
+		ptree root;
+		stringstream output;
+		root.put("host_", host);
+		root.put("port_", port);
+
+		write_json(output, root);
+		frame->append(output.str());
+	}
+
+	put_header(*frame, REDIRECT, frame->size() - sizeof(header), version);
+	return frame;
+}
+
+frame_ptr auth_message::construct_heartbeat_frame(Heartbeat_Kind kind, uint8_t version)
+{
+	auto frame = make_shared<string>(sizeof(header), 0);
+	frame->push_back(static_cast<char>(kind));
+	put_header(*frame, HEARTBEAT, 1, version);
+	return frame;
+}
+
+Heartbeat_Kind auth_message::parse_heartbeat_msg()
+{
+	if (body_len_ != 1 || (body_[0] != HEARTBEAT_PING && body_[0] != HEARTBEAT_PONG))
+	{
+		throw runtime_error("heartbeat msg invalid");
+	}
+	return static_cast<Heartbeat_Kind>(body_[0]);
+}
+
+//Parsing authentication information received from the client
+bool auth_message::parse_auth_res_msg(auth_info& auth)
+{
+	if (header_.version_ == MSG_VERSION_BINARY)
+	{
+		if (get_auth_record(body_, body_len_, auth) != body_len_)
+		{
+			throw runtime_error("auth msg length error");
+		}
+	}
+	else
+	{
+		ptree root;
+		istringstream input(string(body_, body_len_));
+		read_json(input, root);
+		get_auth_json(root, auth);
+	}
+	return check_auth(auth);
+}
+
+//Parsing a batch of authentication information received from the client
+void auth_message::parse_auth_batch_msg(vector<auth_info>& auths)
+{
+	auth_info auth;
+	if (header_.version_ == MSG_VERSION_BINARY)
+	{
+		if (body_len_ < 2)
+		{
+			throw runtime_error("auth batch length error");
+		}
+		uint16_t count = get_uint16(body_);
+		if (count == 0)
+		{
+			throw runtime_error("auth batch is empty");
+		}
+		size_t pos = 2;
+		for (uint16_t i = 0; i < count; i++)
+		{
+			pos += get_auth_record(body_ + pos, body_len_ - pos, auth);
+			if (check_auth(auth))
+				auths.push_back(auth);
+		}
+		if (pos != body_len_)
+		{
+			throw runtime_error("auth batch length error");
+		}
+	}
+	else
+	{
+		ptree root;
+		istringstream input(string(body_, body_len_));
+		read_json(input, root);
+		for (auto& child : root.get_child("auths_"))
+		{
+			get_auth_json(child.second, auth);
+			if (check_auth(auth))
+				auths.push_back(auth);
+		}
+	}
+}
+
+uint32_t auth_message::remaining_duration(const auth_info& auth)
+{
+	return auth.duration_ - (time(0) - auth.auth_time_);
+}
+
+void auth_message::put_auth_json(ptree& root, const auth_info& auth, uint32_t duration)
 {
-	ptree root;
-	stringstream output;
 	root.put("mac_", auth.mac_);
 	root.put("attr_", auth.attr_);
-	root.put("duration_", auth.duration_ - (time(0) - auth.auth_time_));
+	root.put("duration_", duration);
 	root.put("auth_time_", auth.auth_time_);
 	root.put("res1_", auth.res1_);
 	root.put("res2_", auth.res2_);
-
-	write_json(output, root);
-	send_body_ = output.str();
-
-	set_header(AUTH_RESPONSE);
-	send_buffers_.clear();
-	send_buffers_.push_back(boost::asio::buffer(header_buffer_));
-	send_buffers_.push_back(boost::asio::buffer(send_body_));
+	if (auth.seq_)
+		root.put("seq_", auth.seq_);
 }
 
-//Parsing authentication information received from the client
-void auth_message::parse_auth_res_msg(auth_info& auth)
+void auth_message::get_auth_json(const ptree& root, auth_info& auth)
 {
-	ptree root;
-	istringstream input(string(recv_body_.begin(), recv_body_.end()));
-	read_json(input, root);
-
 	auth.mac_ = root.get<string>("mac_");
 	auth.attr_ = root.get<uint16_t>("attr_");
-	auth.auth_time_ = time(0);
 	auth.duration_ = root.get<uint32_t>("duration_");
 	auth.res1_ = root.get<uint32_t>("res1_");
 	auth.res2_ = root.get<uint32_t>("res2_");
+	auth.seq_ = 0;
+}
+
+//The auth time is the server's receive time, the mac is kept as "AA:BB:CC:DD:EE:FF".
+//False for an invalid mac, the record is skipped and the rest of the msg still counts
+bool auth_message::check_auth(auth_info& auth)
+{
+	auth.auth_time_ = time(0);
+
+	uint8_t mac[6];
+	if (!mac_to_bytes(auth.mac_, mac))
+	{
+		metrics::add(INVALID_MACS);
+		AUTH_LOG(debug) << "skip auth with invalid mac:" << auth.mac_;
+		return false;
+	}
+	auth.mac_ = bytes_to_mac(mac);
+	return true;
+}
+
+//Zero reserved fields and sequence are left out of the extensions
+void auth_message::put_auth_record(string& body, const auth_info& auth, uint32_t duration)
+{
+	uint8_t mac[6] = { 0 };
+	mac_to_bytes(auth.mac_, mac);
+	body.append(reinterpret_cast<const char*>(mac), sizeof(mac));
+	put_uint16(body, auth.attr_);
+	put_uint32(body, duration);
+	put_uint32(body, auth.auth_time_);
+
+	uint8_t ext_len = (auth.res1_ ? 6 : 0) + (auth.res2_ ? 6 : 0) + (auth.seq_ ? 10 : 0);
+	put_uint8(body, ext_len);
+	if (auth.res1_)
+	{
+		put_uint8(body, EXT_RES1);
+		put_uint8(body, 4);
+		put_uint32(body, auth.res1_);
+	}
+	if (auth.res2_)
+	{
+		put_uint8(body, EXT_RES2);
+		put_uint8(body, 4);
+		put_uint32(body, auth.res2_);
+	}
+	if (auth.seq_)
+	{
+		put_uint8(body, EXT_SEQ);
+		put_uint8(body, 8);
+		put_uint64(body, auth.seq_);
+	}
+}
+
+//Return the size of the record, unknown extensions are skipped
+size_t auth_message::get_auth_record(const char* data, size_t size, auth_info& auth)
+{
+	const size_t fixed_len = 17;
+	if (size < fixed_len)
+	{
+		throw runtime_error("auth record length error");
+	}
 
+	auth.mac_ = bytes_to_mac(reinterpret_cast<const uint8_t*>(data));
+	auth.attr_ = get_uint16(data + 6);
+	auth.duration_ = get_uint32(data + 8);
+	auth.auth_time_ = get_uint32(data + 12);
+	auth.res1_ = 0;
+	auth.res2_ = 0;
+	auth.seq_ = 0;
+
+	size_t ext_len = static_cast<uint8_t>(data[16]);
+	if (size < fixed_len + ext_len)
+	{
+		throw runtime_error("auth record extension length error");
+	}
+
+	const char* ext = data + fixed_len;
+	const char* end = ext + ext_len;
+	while (ext + 2 <= end)
+	{
+		uint8_t type = ext[0];
+		uint8_t len = ext[1];
+		ext += 2;
+		if (ext + len > end)
+		{
+			throw runtime_error("auth record extension invalid");
+		}
+		if (type == EXT_RES1 && len == 4)
+			auth.res1_ = get_uint32(ext);
+		else if (type == EXT_RES2 && len == 4)
+			auth.res2_ = get_uint32(ext);
+		else if (type == EXT_SEQ && len == 8)
+			auth.seq_ = get_uint64(ext);
+		ext += len;
+	}
+
+	return fixed_len + ext_len;
+}
+
+//The value of a hex digit, -1 for any other byte of the client's input
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+//Accept "AA:BB:CC:DD:EE:FF", "AA-BB-CC-DD-EE-FF" and "AABBCCDDEEFF"
+bool auth_message::mac_to_bytes(const string& mac, uint8_t bytes[6])
+{
+	size_t pos = 0;
+	for (int i = 0; i < 6; i++)
+	{
+		if (i > 0 && pos < mac.size() && (mac[pos] == ':' || mac[pos] == '-'))
+			pos++;
+		if (pos + 2 > mac.size())
+			return false;
+		int high = hex_digit(mac[pos]);
+		int low = hex_digit(mac[pos + 1]);
+		if (high < 0 || low < 0)
+			return false;
+
+		bytes[i] = static_cast<uint8_t>(high << 4 | low);
+		pos += 2;
+	}
+	return pos == mac.size();
+}
+
+uint64_t auth_message::mac_key(const string& mac)
+{
+	uint8_t bytes[6];
+	if (!mac_to_bytes(mac, bytes))
+		return 0;
+
+	uint64_t key = 1;//valid bit above the 48 bits of mac
+	for (int i = 0; i < 6; i++)
+		key = (key << 8) | bytes[i];
+	return key;
+}
+
+string auth_message::bytes_to_mac(const uint8_t bytes[6])
+{
+	char buffer[18];
+	snprintf(buffer, sizeof(buffer), "%02X:%02X:%02X:%02X:%02X:%02X",
+		bytes[0], bytes[1], bytes[2], bytes[3], bytes[4], bytes[5]);
+	return buffer;
 }
 
 string auth_message::random_string(size_t length)
@@ -13,7 +13,9 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 #include <boost/asio.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
 
 enum Msg_Type
 {
@@ -24,10 +26,51 @@ enum Msg_Type
 
 	AUTH_REQUEST,	// Request client auth 
 	AUTH_RESPONSE,	// client auth result
+	AUTH_BATCH,		// many auth results in one msg
+	REDIRECT,		// the gid is served by another server, connect there
+
+	PEER_HELLO,		// server to server: challenge, then its md5 with server_pwd
+	PEER_UPDATE,	// server to server: records of a group
+	PEER_DIGEST,	// server to server: digests of the groups
+	PEER_CHUNKS,	// server to server: chunk digests of a group whose digest differs
+	HEARTBEAT,		// liveness probe, the body is one Heartbeat_Kind byte
 
 	MSG_TYPE_NR
 };
 
+//Wire versions, header::version_ of every frame tells how its body is encoded
+enum Msg_Version
+{
+	MSG_VERSION_JSON = 1,	// json body
+	MSG_VERSION_BINARY = 2,	// fixed layout binary body, integers in network order
+
+	MSG_VERSION_NR
+};
+
+//Capability bits a client reports in chap::res1_ of CHECK_CLIENT_RESPONSE
+enum Capability
+{
+	CAP_BINARY = 0x01,	// send MSG_VERSION_BINARY msgs to me
+	CAP_BATCH = 0x02,	// I understand AUTH_BATCH msgs
+	CAP_HEARTBEAT = 0x04,	// I answer HEARTBEAT pings, reap me when I go silent
+};
+
+//A ping is answered with a pong, a pong is not answered
+enum Heartbeat_Kind
+{
+	HEARTBEAT_PING = 0,
+	HEARTBEAT_PONG = 1,
+};
+
+//Extensions following the fixed part of a binary auth record,
+//each is a type byte, a length byte and the value
+enum Auth_Ext
+{
+	EXT_RES1 = 1,	// auth_info::res1_, uint32
+	EXT_RES2 = 2,	// auth_info::res2_, uint32
+	EXT_SEQ = 3,	// auth_info::seq_, uint64
+};
+
 // Structure to hold information about a single stock.
  struct header
 {
@@ -45,6 +88,7 @@ struct auth_info
 	uint32_t auth_time_;      
 	uint32_t res1_;// reserve
 	uint32_t res2_;// reserve
+	uint64_t seq_ = 0;// group sequence of the last change, 0 until the group stores it
 };
 
 //Challenge Handshake Authentication Protocol
@@ -53,7 +97,23 @@ struct chap
 	uint32_t gid_; //Clients report their own group ID
 	uint32_t res1_;// reserve
 	std::string chap_str_;//Encrypting data by MD5 algorithm
+	uint64_t last_seq_ = 0;//The last group sequence the client has seen, 0 asks for a full resync
+};
+
+//An encoded frame (header + body), shared by the send queues without copying
+typedef std::shared_ptr<const std::string> frame_ptr;
+
+class msg_trace;
+
+//A frame ready for the send queue, key_ is mac_key() of a single auth frame and 0 otherwise.
+//trace_ is set on the frames of a traced msg
+struct keyed_frame
+{
+	frame_ptr frame_;
+	uint64_t key_;
+	std::shared_ptr<msg_trace> trace_;
 };
+typedef std::shared_ptr<const std::vector<keyed_frame> > frame_list_ptr;
 
 class auth_message
 {
@@ -61,16 +121,55 @@ public:
 	
 	void set_header(Msg_Type msg);//The head must be set before sending
 	void parse_header();//Parsing the header information received from the client
+	void set_body(const char* data, size_t len);//The body of the frame to parse, not copied
 	
 	void constuct_check_client_msg();//Verify the validity of the client
 	void parse_check_client_res_msg();//Verify the validity of the client
 
-	void constuct_auth_res_msg(const auth_info& auth);//Sending the authentication information to the client
-	void parse_auth_res_msg(auth_info& auth); //Parsing authentication information received from the client
+	static frame_ptr construct_auth_res_frame(const auth_info& auth, uint8_t version);//Sending the authentication information to the client
+	bool parse_auth_res_msg(auth_info& auth); //Parsing authentication information received from the client, false if its mac is invalid
+
+	//AUTH_BATCH body is count[2] + records when binary, {"auths_":[...]} when json
+	static std::vector<frame_ptr> construct_auth_batch_frames(const std::vector<auth_info>& auths, uint8_t version);
+
+	//AUTH_BATCH frames when batch is set and there are many records, one AUTH_RESPONSE per record otherwise
+	static frame_list_ptr construct_auth_frames(const std::vector<auth_info>& auths, uint8_t version, bool batch);
+	void parse_auth_batch_msg(std::vector<auth_info>& auths);
+
+	//REDIRECT body is port[2] + host when binary, {"host_":..,"port_":..} when json
+	static frame_ptr construct_redirect_frame(const std::string& host, uint16_t port, uint8_t version);
+
+	//HEARTBEAT body is one Heartbeat_Kind byte in every version
+	static frame_ptr construct_heartbeat_frame(Heartbeat_Kind kind, uint8_t version);
+	Heartbeat_Kind parse_heartbeat_msg();
+
+	uint8_t wire_version() const;//The version the client asked to receive
+	uint64_t last_seq() const;//The last group sequence the client has seen
+	bool has_capability(Capability cap) const;//Capabilities the client reported
+
+	//Free the handshake buffers and the buffer of a frame larger than a receive block, between msgs
+	void trim();
+
+	static bool mac_to_bytes(const std::string& mac, uint8_t bytes[6]);//"AA:BB:CC:DD:EE:FF" to 6 bytes
+	static std::string bytes_to_mac(const uint8_t bytes[6]);
+	static uint64_t mac_key(const std::string& mac);//Nonzero integer key of a valid mac
 
 private:
 	friend class connection;
 
+	static const size_t max_body_len = 65535;//header::len_ is 16 bits
+
+	static void put_header(std::string& frame, Msg_Type type, size_t body_len, uint8_t version);//Prepend a header to a frame
+
+	static uint32_t remaining_duration(const auth_info& auth);
+	static void put_auth_json(boost::property_tree::ptree& root, const auth_info& auth, uint32_t duration);
+	static void get_auth_json(const boost::property_tree::ptree& root, auth_info& auth);
+	static bool check_auth(auth_info& auth);
+
+	//Binary auth record: mac[6] attr[2] duration[4] auth_time[4] ext_len[1] ext[ext_len]
+	static void put_auth_record(std::string& body, const auth_info& auth, uint32_t duration);
+	static size_t get_auth_record(const char* data, size_t size, auth_info& auth);
+
 	std::string random_string(size_t length);
 	std::string string_to_base16(const std::string& str);
 	std::string base16_to_string(const std::string& str);
@@ -81,8 +180,11 @@ private:
 		char header_buffer_[sizeof(header)];
 	};
 	chap server_chap_;
+	uint8_t wire_version_ = MSG_VERSION_JSON;
 	std::string send_body_;
-	std::vector<char> recv_body_;
+	const char* body_ = nullptr;
+	size_t body_len_ = 0;
+	std::vector<char> recv_body_;//A frame larger than a receive block is read here
 	std::vector<boost::asio::const_buffer> send_buffers_;
 };
 #endif // AUTH_MESSAGEH_HPP
\ No newline at end of file
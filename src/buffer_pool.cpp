@@ -0,0 +1,78 @@
+#include "buffer_pool.hpp"
+#include "auth_config.hpp"
+#include <vector>
+
+using namespace std;
+using boost::serialization::singleton;
+
+atomic<int64_t> buffer_pool::in_use_(0);
+atomic<int64_t> buffer_pool::pooled_(0);
+
+struct buffer_pool::free_list
+{
+	vector<char*> blocks_;
+	size_t keep_;
+
+	free_list()
+		: keep_(singleton<auth_config>::get_const_instance().recv_buffer_pool_)
+	{
+		blocks_.reserve(keep_);
+	}
+
+	//The blocks of an exiting thread go back to the heap
+	~free_list()
+	{
+		pooled_.fetch_sub(blocks_.size(), memory_order_relaxed);
+		for (auto block : blocks_)
+			delete[] block;
+	}
+};
+
+buffer_pool::free_list& buffer_pool::local()
+{
+	static thread_local free_list list;
+	return list;
+}
+
+size_t buffer_pool::block_size()
+{
+	return singleton<auth_config>::get_const_instance().recv_buffer_size_;
+}
+
+char* buffer_pool::acquire()
+{
+	in_use_.fetch_add(1, memory_order_relaxed);
+
+	free_list& list = local();
+	if (list.blocks_.empty())
+		return new char[block_size()];
+
+	pooled_.fetch_sub(1, memory_order_relaxed);
+	char* block = list.blocks_.back();
+	list.blocks_.pop_back();
+	return block;
+}
+
+void buffer_pool::release(char* block)
+{
+	in_use_.fetch_sub(1, memory_order_relaxed);
+
+	free_list& list = local();
+	if (list.blocks_.size() >= list.keep_)
+	{
+		delete[] block;
+		return;
+	}
+	pooled_.fetch_add(1, memory_order_relaxed);
+	list.blocks_.push_back(block);
+}
+
+int64_t buffer_pool::in_use()
+{
+	return in_use_.load(memory_order_relaxed);
+}
+
+int64_t buffer_pool::pooled()
+{
+	return pooled_.load(memory_order_relaxed);
+}
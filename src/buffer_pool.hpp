@@ -0,0 +1,33 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+//Fixed size receive blocks shared by the connections. A connection holds a block only
+//while it has unparsed bytes, an idle one waits for readability without any.
+//A released block goes to the releasing thread's free list, up to recv_buffer_pool
+//blocks, the rest go back to the heap. No lock is taken.
+class buffer_pool
+{
+public:
+	static char* acquire();
+	static void release(char* block);
+
+	//recv_buffer_size
+	static std::size_t block_size();
+
+	//Blocks held by the connections, and blocks waiting in the free lists
+	static int64_t in_use();
+	static int64_t pooled();
+
+private:
+	struct free_list;
+	static free_list& local();
+
+	static std::atomic<int64_t> in_use_;
+	static std::atomic<int64_t> pooled_;
+};
+
+#endif
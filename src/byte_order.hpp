@@ -0,0 +1,64 @@
+#ifndef BYTE_ORDER_HPP
+#define BYTE_ORDER_HPP
+
+#include <cstdint>
+#include <string>
+
+//Integers in the binary frames, the peer link and the local store are in network order
+
+inline void put_uint8(std::string& out, uint8_t v)
+{
+	out.push_back(static_cast<char>(v));
+}
+
+inline void put_uint16(std::string& out, uint16_t v)
+{
+	put_uint8(out, v >> 8);
+	put_uint8(out, v & 0xff);
+}
+
+inline void put_uint32(std::string& out, uint32_t v)
+{
+	put_uint16(out, v >> 16);
+	put_uint16(out, v & 0xffff);
+}
+
+inline void put_uint64(std::string& out, uint64_t v)
+{
+	put_uint32(out, v >> 32);
+	put_uint32(out, v & 0xffffffff);
+}
+
+//The low bytes of value, for widths without a type of their own such as a 6 byte mac
+inline void put_uint(std::string& out, uint64_t value, int bytes)
+{
+	for (int i = bytes - 1; i >= 0; i--)
+		put_uint8(out, (value >> (i * 8)) & 0xff);
+}
+
+inline uint64_t get_uint(const void* p, int bytes)
+{
+	const uint8_t* u = static_cast<const uint8_t*>(p);
+	uint64_t value = 0;
+	for (int i = 0; i < bytes; i++)
+		value = (value << 8) | u[i];
+	return value;
+}
+
+inline uint16_t get_uint16(const char* p)
+{
+	const uint8_t* u = reinterpret_cast<const uint8_t*>(p);
+	return static_cast<uint16_t>((u[0] << 8) | u[1]);
+}
+
+inline uint32_t get_uint32(const char* p)
+{
+	return (static_cast<uint32_t>(get_uint16(p)) << 16) | get_uint16(p + 2);
+}
+
+inline uint64_t get_uint64(const char* p)
+{
+	return (static_cast<uint64_t>(get_uint32(p)) << 32) | get_uint32(p + 4);
+}
+
+#endif
@@ -0,0 +1,86 @@
+#include "cluster_ring.hpp"
+#include "md5.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+cluster_ring::cluster_ring(const vector<string>& nodes, const string& self, size_t vnodes)
+	: self_(nodes.size())
+{
+	vnodes = max<size_t>(vnodes, 1);
+
+	for (auto& node : nodes)
+	{
+		auto colon = node.rfind(':');
+		if (colon == string::npos || colon == 0)
+			throw runtime_error("cluster node " + node + " is not host:port");
+		int port = stoi(node.substr(colon + 1));
+		if (port <= 0 || port > 65535)
+			throw runtime_error("cluster node " + node + " has an invalid port");
+
+		if (node == self)
+			self_ = nodes_.size();
+		for (size_t i = 0; i < vnodes; i++)
+			points_.push_back(make_pair(point_hash(node, i), nodes_.size()));
+		nodes_.push_back(cluster_node{ node.substr(0, colon), static_cast<uint16_t>(port) });
+	}
+
+	if (self_ == nodes_.size())
+		throw runtime_error("cluster_self " + self + " is not one of cluster_nodes");
+
+	sort(points_.begin(), points_.end());
+}
+
+const cluster_node& cluster_ring::owner(unsigned gid) const
+{
+	return nodes_[owner_index(gid)];
+}
+
+bool cluster_ring::owns(unsigned gid) const
+{
+	return owner_index(gid) == self_;
+}
+
+double cluster_ring::share() const
+{
+	//A point owns the arc from the previous point up to itself
+	uint64_t owned = 0;
+	for (size_t i = 0; i < points_.size(); i++)
+	{
+		if (points_[i].second != self_)
+			continue;
+		uint32_t prev = i ? points_[i - 1].first : points_.back().first;
+		owned += static_cast<uint32_t>(points_[i].first - prev);
+	}
+	return points_.size() == 1 ? 1.0 : owned / 4294967296.0;
+}
+
+size_t cluster_ring::owner_index(unsigned gid) const
+{
+	auto it = lower_bound(points_.begin(), points_.end(), make_pair(gid_hash(gid), size_t(0)));
+	if (it == points_.end())
+		it = points_.begin();
+	return it->second;
+}
+
+uint32_t cluster_ring::point_hash(const string& node, size_t vnode)
+{
+	uint8_t ret[16];
+	md5 md5;
+	string key = node + "#" + to_string(vnode);
+	md5.md5_once(&key[0], key.size(), ret);
+	return (uint32_t(ret[0]) << 24) | (uint32_t(ret[1]) << 16) | (uint32_t(ret[2]) << 8) | ret[3];
+}
+
+uint32_t cluster_ring::gid_hash(unsigned gid)
+{
+	//murmur3 finalizer, neighbouring gids land far apart
+	uint32_t h = gid;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
@@ -0,0 +1,45 @@
+#ifndef CLUSTER_RING_HPP
+#define CLUSTER_RING_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <boost/noncopyable.hpp>
+
+//A server of the cluster, the address clients are redirected to
+struct cluster_node
+{
+	std::string host_;
+	uint16_t port_;
+};
+
+//Consistent hashing of the gids onto the cluster nodes. Every node puts vnodes points
+//on a 32-bit ring and owns the gids hashing up to each of its points, so adding or
+//removing a node only moves the gids of its own ranges.
+class cluster_ring
+	: private boost::noncopyable
+{
+public:
+	//nodes are "host:port", self is the one this server serves. Servers that replicate
+	//each other as peers name the same self and share its range
+	cluster_ring(const std::vector<std::string>& nodes, const std::string& self, std::size_t vnodes);
+
+	const cluster_node& owner(unsigned gid) const;
+	bool owns(unsigned gid) const;
+
+	//Share of the ring self owns, 0 to 1
+	double share() const;
+
+private:
+	std::size_t owner_index(unsigned gid) const;
+
+	static uint32_t point_hash(const std::string& node, std::size_t vnode);
+	static uint32_t gid_hash(unsigned gid);
+
+	std::vector<cluster_node> nodes_;
+	std::vector<std::pair<uint32_t, std::size_t> > points_;//sorted by hash, second is the node
+	std::size_t self_;
+};
+
+#endif
@@ -8,125 +8,612 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <cstring>
 #include <stdexcept>
+#include <netinet/tcp.h>
+#include <unordered_set>
 #include <utility>
-#include <boost/log/trivial.hpp>
+#include "async_log.hpp"
 #include "auth_config.hpp"
 #include "server.hpp"
 #include "connection.hpp"
+#include "metrics.hpp"
+#include "buffer_pool.hpp"
+#include <boost/asio/yield.hpp>
 
 using namespace std;
 using boost::asio::ip::tcp;
 using boost::asio::async_write;
 using boost::asio::async_read;
-using boost::asio::spawn;
 using std::placeholders::_1;
+using namespace std::chrono;
 
+overflow_counters connection::overflow_counters_;
 
 
 //Constructor
-connection::connection(tcp::socket socket, server* server)
-	: socket_(std::move(socket)),
-	strand_(socket_.get_io_service()),
+connection::connection(tcp::socket socket, boost::asio::io_service& io_service, server* server)
+	: deadline_(io_service),
+	socket_(std::move(socket)),
+	strand_(io_service),
 	sync_server_(server)
 {
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+	send_queue_max_ = config.send_queue_max_;
+	send_bytes_max_ = config.send_bytes_max_;
+	overflow_policy_ = config.overflow_policy_;
+}
+
+connection::~connection()
+{
+	if (recv_buf_)
+		buffer_pool::release(recv_buf_);
 }
 
 //The new session begins to execute
 void connection::start()
 {
-	spawn(strand_,std::bind(&connection::do_process, shared_from_this(), _1));
+	set_keepalive();
+
+	//read_some must not block, the loop waits for readability instead
+	boost::system::error_code ec;
+	socket_.non_blocking(true, ec);
+	strand_.post(std::bind(&connection::do_process, shared_from_this(), ec));
 }
 
 //service processing entry
-void connection::do_process(boost::asio::yield_context yield)
+//Only members live across a yield, the coroutine has no stack
+void connection::do_process(const boost::system::error_code& ec)
 {
-	try
+	if (ec)
 	{
-		//connection_str_ for debug
-		connection_str_ = socket_.remote_endpoint().address().to_string()
-			+ ":" + std::to_string(socket_.remote_endpoint().port());
-
-		// First to check whether the client is valid
-		auth_message_.constuct_check_client_msg();
-		async_write(socket_, auth_message_.send_buffers_, yield);
+		finish(ec.message());
+		return;
+	}
 
-		for (;;)
+	try
+	{
+		reenter (this)
 		{
-			//read header
-			async_read(socket_, boost::asio::buffer(auth_message_.header_buffer_), yield);
-			auth_message_.parse_header();
+			metrics::add(CONNECTIONS_HANDSHAKE);
+			{
+				const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+				if (config.handshake_timeout_ > 0)
+					arm_deadline(seconds(config.handshake_timeout_));
+			}
 
-			//read body
-			async_read(socket_, boost::asio::buffer(auth_message_.recv_body_), yield);
+			//connection_str_ for debug
+			connection_str_ = socket_.remote_endpoint().address().to_string()
+				+ ":" + std::to_string(socket_.remote_endpoint().port());
 
-			switch (auth_message_.header_.type_)
+			// First to check whether the client is valid
+			auth_message_.constuct_check_client_msg();
+			yield async_write(socket_, auth_message_.send_buffers_,
+				strand_.wrap(std::bind(&connection::do_process, shared_from_this(), _1)));
+			metrics::frame_out(CHECK_CLIENT, boost::asio::buffer_size(auth_message_.send_buffers_));
+
+			for (;;)
 			{
-			case CHECK_CLIENT_RESPONSE:
-				do_check_client_response(yield);
-				break;
-			case AUTH_RESPONSE:
-				do_auth_response(yield);
-				break;
-			default:
-				BOOST_LOG_TRIVIAL(error) << "client " << to_string() << " send an invalid msg type";
+				//Every complete frame received so far, a pipelining client costs one read per block
+				while (!redirect_ && next_frame())
+					handle_frame();
+
+				//In cluster mode another server may own the gid, the client goes there
+				if (redirect_)
+				{
+					yield async_write(socket_, boost::asio::buffer(*redirect_),
+						strand_.wrap(std::bind(&connection::do_process, shared_from_this(), _1)));
+					metrics::frame_out(REDIRECT, redirect_->size());
+					metrics::add(REDIRECTS);
+					{
+						unsigned gid = auth_message_.server_chap_.gid_;
+						const cluster_node* owner = sync_server_->redirect_of(gid);
+						finish("gid " + std::to_string(gid) + " redirected to "
+							+ owner->host_ + ":" + std::to_string(owner->port_), false);
+					}
+					return;
+				}
+
+				if (large_frame_)
+				{
+					yield async_read(socket_, boost::asio::buffer(&auth_message_.recv_body_[large_have_],
+						auth_message_.recv_body_.size() - large_have_),
+						strand_.wrap(std::bind(&connection::do_process, shared_from_this(), _1)));
+					large_frame_ = false;
+					last_read_ = steady_clock::now();
+					pinged_ = false;
+					auth_message_.set_body(auth_message_.recv_body_.data(), auth_message_.recv_body_.size());
+					handle_frame();
+					continue;
+				}
+
+				//An idle connection keeps small buffers only
+				auth_message_.trim();
+
+				if (!recv_full_)
+				{
+					if (recv_buf_ && recv_begin_ == recv_end_)
+					{
+						buffer_pool::release(recv_buf_);
+						recv_buf_ = nullptr;
+					}
+					yield socket_.async_wait(tcp::socket::wait_read,
+						strand_.wrap(std::bind(&connection::do_process, shared_from_this(), _1)));
+				}
+				read_some();
 			}
 		}
 	}
 	catch (std::exception& e)
 	{
-		BOOST_LOG_TRIVIAL(error) << "socket closed because of " << e.what();
-		if(certified_)
-			auth_group_->leave(shared_from_this());
+		finish(e.what());
 	}
+}
 
+void connection::read_some()
+{
+	if (!recv_buf_)
+	{
+		recv_buf_ = buffer_pool::acquire();
+		recv_begin_ = recv_end_ = 0;
+	}
+	else if (recv_begin_ > 0)
+	{
+		//Only the start of a frame is left, move it to the front
+		memmove(recv_buf_, recv_buf_ + recv_begin_, recv_end_ - recv_begin_);
+		recv_end_ -= recv_begin_;
+		recv_begin_ = 0;
+	}
+
+	size_t space = buffer_pool::block_size() - recv_end_;
+	boost::system::error_code ec;
+	size_t n = socket_.read_some(boost::asio::buffer(recv_buf_ + recv_end_, space), ec);
+	if (ec == boost::asio::error::would_block)
+	{
+		recv_full_ = false;
+		return;
+	}
+	if (ec)
+		throw boost::system::system_error(ec);
+
+	metrics::add(RECV_READS);
+	recv_end_ += n;
+	recv_full_ = (n == space);
+	last_read_ = steady_clock::now();
+	pinged_ = false;
+}
+
+bool connection::next_frame()
+{
+	size_t have = recv_end_ - recv_begin_;
+	if (have < sizeof(header))
+		return false;
+
+	memcpy(auth_message_.header_buffer_, recv_buf_ + recv_begin_, sizeof(header));
+	auth_message_.parse_header();
+	size_t len = auth_message_.header_.len_;
+
+	if (sizeof(header) + len > buffer_pool::block_size())
+	{
+		//The rest of it is read straight into recv_body_
+		auth_message_.recv_body_.resize(len);
+		large_have_ = have - sizeof(header);
+		memcpy(auth_message_.recv_body_.data(), recv_buf_ + recv_begin_ + sizeof(header), large_have_);
+		recv_begin_ = recv_end_ = 0;
+		recv_full_ = false;
+		large_frame_ = true;
+		return false;
+	}
+	if (have < sizeof(header) + len)
+		return false;
+
+	auth_message_.set_body(recv_buf_ + recv_begin_ + sizeof(header), len);
+	recv_begin_ += sizeof(header) + len;
+	return true;
 }
+
+void connection::handle_frame()
+{
+	if (auth_message_.header_.type_ == AUTH_RESPONSE || auth_message_.header_.type_ == AUTH_BATCH)
+	{
+		trace_ = msg_trace::sample();
+		if (trace_)
+			trace_->mark(TRACE_BODY_READ);
+	}
+	metrics::frame_in(auth_message_.header_.type_, sizeof(header) + auth_message_.body_len_);
+
+	switch (auth_message_.header_.type_)
+	{
+	case CHECK_CLIENT_RESPONSE:
+		redirect_ = do_check_client_response();
+		break;
+	case AUTH_RESPONSE:
+		do_auth_response();
+		break;
+	case AUTH_BATCH:
+		do_auth_batch();
+		break;
+	case HEARTBEAT:
+		do_heartbeat();
+		break;
+	default:
+		AUTH_LOG(error) << "client " << to_string() << " send an invalid msg type";
+	}
+	trace_.reset();
+}
+
+void connection::finish(const std::string& reason, bool failed)
+{
+	if (failed)
+		AUTH_LOG(error) << "socket closed because of " << reason;
+	else
+		AUTH_LOG(info) << "socket closed because of " << reason;
+	if (recv_buf_)
+	{
+		buffer_pool::release(recv_buf_);
+		recv_buf_ = nullptr;
+	}
+	if(certified_)
+		auth_group_->leave(shared_from_this());
+	//Frames already posted to the strand find the socket closed and are dropped
+	close();
+	//The pending wait holds the connection
+	deadline_.cancel();
+	metrics::add(certified_ ? CONNECTIONS_CERTIFIED : CONNECTIONS_HANDSHAKE, -1);
+}
+
 //Client reply check message
-void connection::do_check_client_response( boost::asio::yield_context& yield)
+frame_ptr connection::do_check_client_response()
 {
 	if (!certified_)
 	{
-		auth_message_.parse_check_client_res_msg();
-		auth_group_ = &(sync_server_->group(auth_message_.server_chap_.gid_));
-		auth_group_->join(shared_from_this());
+		try
+		{
+			auth_message_.parse_check_client_res_msg();
+		}
+		catch (std::exception&)
+		{
+			metrics::add(CHAP_FAILURES);
+			throw;
+		}
+
+		const cluster_node* owner = sync_server_->redirect_of(auth_message_.server_chap_.gid_);
+		if (owner)
+			return auth_message::construct_redirect_frame(owner->host_, owner->port_, auth_message_.wire_version());
+
+		do
+		{
+			auth_group_ = &(sync_server_->group(auth_message_.server_chap_.gid_));
+		} while (!auth_group_->join(shared_from_this(), auth_message_.last_seq()));
 		certified_ = true;
-		BOOST_LOG_TRIVIAL(info) << "client  " << to_string() << " is certified ,gid is"  << auth_message_.server_chap_.gid_;
+		arm_idle_deadline();
+		metrics::add(CONNECTIONS_HANDSHAKE, -1);
+		metrics::add(CONNECTIONS_CERTIFIED);
+		AUTH_LOG(info) << "client  " << to_string() << " is certified ,gid is"  << auth_message_.server_chap_.gid_;
 	}
 	else
 	{
-		BOOST_LOG_TRIVIAL(error) << "client  " << to_string() << " is already certified";
+		AUTH_LOG(error) << "client  " << to_string() << " is already certified";
 	}
+	return frame_ptr();
 }
 
 //Receive authentication information from the client
-void connection::do_auth_response(boost::asio::yield_context& yield)
+void connection::do_auth_response()
 {
 	if (certified_)
 	{
 		auth_info auth;
-		auth_message_.parse_auth_res_msg(auth);
-		auth_group_->insert(auth);
-		sync_server_->get_db().insert(auth_message_.server_chap_.gid_, auth);
+		if (!auth_message_.parse_auth_res_msg(auth))
+			return;
+		if (trace_)
+			trace_->mark(TRACE_PARSED);
+		{
+			msg_trace::scope scope(trace_.get());
+			while (!auth_group_->insert(auth))
+				auth_group_ = &(sync_server_->group(auth_message_.server_chap_.gid_));
+		}
+		if (trace_)
+			trace_->mark(TRACE_STORED);
+		sync_server_->persist(auth_message_.server_chap_.gid_, auth);
+		if (trace_)
+			trace_->mark(TRACE_PERSISTED);
+	}
+	else
+	{
+		AUTH_LOG(error) << "client  " << to_string() << " isn't authed, just ignore it";
 	}
+}
+
+//A batch of authentication information received from the client
+void connection::do_auth_batch()
+{
+	if (certified_)
+	{
+		vector<auth_info> auths;
+		auth_message_.parse_auth_batch_msg(auths);
+		if (auths.empty())
+			return;
+		if (trace_)
+			trace_->mark(TRACE_PARSED);
+		{
+			msg_trace::scope scope(trace_.get());
+			while (!auth_group_->insert(auths))
+				auth_group_ = &(sync_server_->group(auth_message_.server_chap_.gid_));
+		}
+		if (trace_)
+			trace_->mark(TRACE_STORED);
+		sync_server_->persist(auth_message_.server_chap_.gid_, auths);
+		if (trace_)
+			trace_->mark(TRACE_PERSISTED);
+	}
+	else
+	{
+		AUTH_LOG(error) << "client  " << to_string() << " isn't authed, just ignore it";
+	}
+}
+
+//A ping is answered through the send queue, a pong only restarted the idle time
+void connection::do_heartbeat()
+{
+	if (auth_message_.parse_heartbeat_msg() == HEARTBEAT_PING)
+		enqueue(keyed_frame{ auth_message::construct_heartbeat_frame(HEARTBEAT_PONG, wire_version()), 0 });
+}
+
+void connection::set_keepalive()
+{
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+	if (config.tcp_keepalive_idle_ == 0)
+		return;
+
+	typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPIDLE> keepalive_idle;
+	typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPINTVL> keepalive_interval;
+	typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPCNT> keepalive_count;
+
+	boost::system::error_code ec;
+	socket_.set_option(tcp::socket::keep_alive(true), ec);
+	if (!ec)
+		socket_.set_option(keepalive_idle(config.tcp_keepalive_idle_), ec);
+	if (!ec)
+		socket_.set_option(keepalive_interval(config.tcp_keepalive_interval_), ec);
+	if (!ec)
+		socket_.set_option(keepalive_count(config.tcp_keepalive_count_), ec);
+	if (ec)
+		AUTH_LOG(warning) << "set tcp keepalive failed:" << ec.message();
+}
+
+void connection::arm_deadline(steady_clock::duration after)
+{
+	if (!socket_.is_open())
+		return;
+	deadline_.expires_from_now(after);
+	deadline_.async_wait(strand_.wrap(std::bind(&connection::handle_deadline, shared_from_this(), _1)));
+}
+
+//Clients without CAP_HEARTBEAT may not answer a ping, they are only reaped when idle
+void connection::arm_idle_deadline()
+{
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+
+	steady_clock::time_point next = steady_clock::time_point::max();
+	if (config.heartbeat_interval_ > 0 && !pinged_ && auth_message_.has_capability(CAP_HEARTBEAT))
+		next = last_read_ + seconds(config.heartbeat_interval_);
+	if (config.idle_timeout_ > 0)
+		next = min(next, steady_clock::now() - silence() + seconds(config.idle_timeout_));
+
+	if (next == steady_clock::time_point::max())
+		deadline_.cancel();
 	else
+		arm_deadline(next - steady_clock::now());
+}
+
+void connection::handle_deadline(const boost::system::error_code& ec)
+{
+	if (ec || !socket_.is_open())
+		return;
+
+	if (!certified_)
+	{
+		AUTH_LOG(warning) << "client " << to_string() << " didn't finish the handshake in time";
+		metrics::add(CONNECTIONS_REAPED);
+		close();
+		return;
+	}
+
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+	auto idle = silence();
+	if (config.idle_timeout_ > 0 && idle >= seconds(config.idle_timeout_))
+	{
+		AUTH_LOG(warning) << "client " << to_string() << " silent for "
+			<< duration_cast<seconds>(idle).count() << "s, closing it";
+		metrics::add(CONNECTIONS_REAPED);
+		close();
+		return;
+	}
+	if (config.heartbeat_interval_ > 0 && !pinged_ && auth_message_.has_capability(CAP_HEARTBEAT)
+		&& steady_clock::now() - last_read_ >= seconds(config.heartbeat_interval_))
 	{
-		BOOST_LOG_TRIVIAL(error) << "client  " << to_string() << " isn't authed, just ignore it";
+		pinged_ = true;
+		enqueue(keyed_frame{ auth_message::construct_heartbeat_frame(HEARTBEAT_PING, wire_version()), 0 });
 	}
+	arm_idle_deadline();
+}
+
+steady_clock::duration connection::silence()
+{
+	steady_clock::duration idle = steady_clock::now() - last_read_;
+	if (auth_message_.has_capability(CAP_HEARTBEAT))
+		return idle;
+
+	//A half-open socket stops acking, a live client acks the frames and keepalive probes
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if (::getsockopt(socket_.native_handle(), IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+		idle = min<steady_clock::duration>(idle, milliseconds(info.tcpi_last_ack_recv));
+	return idle;
 }
 
-//Authentication information delivered by other clients of the same group
-void connection::deliver(const auth_info& auth)
+//Frames delivered by other clients of the same group
+//It is posted to this connection's shard, the caller holds the group lock and must not wait
+void connection::deliver(frame_list_ptr frames)
 {
-	strand_.dispatch(std::bind(&connection::do_send_auth_msg, shared_from_this(), auth));
+	strand_.post(std::bind(&connection::do_deliver, shared_from_this(), frames));
 }
 
-void connection::do_send_auth_msg(const auth_info& auth)
+uint8_t connection::wire_version() const
 {
-	auth_message_.constuct_auth_res_msg(auth);
-	boost::asio::async_write(socket_, auth_message_.send_buffers_,[](const boost::system::error_code&ec, size_t) {});
+	return auth_message_.wire_version();
+}
+
+bool connection::accepts_batch() const
+{
+	return auth_message_.has_capability(CAP_BATCH);
+}
+
+void connection::do_deliver(frame_list_ptr frames)
+{
+	if (!frames->empty() && frames->front().trace_)
+		frames->front().trace_->mark_peer(TRACE_FIRST_ENQUEUE, TRACE_LAST_ENQUEUE);
+
+	for (auto& frame : *frames)
+		enqueue(frame);
+}
+
+void connection::enqueue(const keyed_frame& frame)
+{
+	if (!socket_.is_open())
+		return;
+
+	size_t size = frame.frame_->size();
+	if ((send_queue_.size() >= send_queue_max_ || send_bytes_ + size > send_bytes_max_)
+		&& !handle_overflow(size))
+		return;
+
+	send_bytes_ += size;
+	send_queue_.push_back(frame);
+
+	if (sending_.empty())
+		do_write();
+}
+
+bool connection::handle_overflow(std::size_t incoming_bytes)
+{
+	if (!overflowed_)
+	{
+		overflowed_ = true;
+		AUTH_LOG(warning) << "client " << to_string() << " is a slow consumer, "
+			<< send_queue_.size() << " msgs and " << send_bytes_ << " bytes pending";
+	}
+
+	if (overflow_policy_ == DISCONNECT)
+	{
+		++overflow_counters_.disconnected_;
+		close();
+		return false;
+	}
+
+	if (overflow_policy_ == COLLAPSE_MAC)
+		collapse_send_queue();
+
+	while (!send_queue_.empty()
+		&& (send_queue_.size() >= send_queue_max_ || send_bytes_ + incoming_bytes > send_bytes_max_))
+	{
+		send_bytes_ -= send_queue_.front().frame_->size();
+		send_queue_.pop_front();
+		++overflow_counters_.dropped_;
+	}
+
+	// The write in flight alone can exceed the byte limit, then the new msg is dropped
+	if (send_bytes_ + incoming_bytes > send_bytes_max_)
+	{
+		++overflow_counters_.dropped_;
+		return false;
+	}
+	return true;
+}
+
+//Keep only the latest queued msg of every mac
+void connection::collapse_send_queue()
+{
+	std::unordered_set<uint64_t> seen;
+	std::deque<keyed_frame> collapsed;
+
+	for (auto it = send_queue_.rbegin(); it != send_queue_.rend(); ++it)
+	{
+		if (it->key_ != 0 && !seen.insert(it->key_).second)
+		{
+			send_bytes_ -= it->frame_->size();
+			++overflow_counters_.collapsed_;
+			continue;
+		}
+		collapsed.push_front(std::move(*it));
+	}
+	send_queue_.swap(collapsed);
+}
+
+void connection::do_write()
+{
+	// writev takes a limited number of buffers per call
+	const std::size_t max_gather = 64;
+
+	while (!send_queue_.empty() && sending_.size() < max_gather)
+	{
+		sending_.push_back(std::move(send_queue_.front().frame_));
+		if (send_queue_.front().trace_)
+			sending_traces_.push_back(std::move(send_queue_.front().trace_));
+		send_queue_.pop_front();
+		metrics::frame_out(static_cast<uint8_t>((*sending_.back())[1]), sending_.back()->size());
+		write_buffers_.push_back(boost::asio::buffer(*sending_.back()));
+	}
+
+	async_write(socket_, write_buffers_, strand_.wrap(std::bind(&connection::handle_write, shared_from_this(), _1)));
+}
+
+void connection::handle_write(const boost::system::error_code& ec)
+{
+	for (auto& frame : sending_)
+		send_bytes_ -= frame->size();
+	sending_.clear();
+	write_buffers_.clear();
+	for (auto& trace : sending_traces_)
+	{
+		if (!ec)
+			trace->mark_peer(TRACE_FIRST_WRITE, TRACE_LAST_WRITE);
+	}
+	sending_traces_.clear();
+
+	if (ec)
+	{
+		AUTH_LOG(error) << "client " << to_string() << " write error:" << ec.message();
+		close();
+		return;
+	}
+
+	if (!send_queue_.empty())
+		do_write();
+	else
+		overflowed_ = false;
+}
+
+//Closing the socket ends the read loop, which leaves the group
+void connection::close()
+{
+	send_queue_.clear();
+	send_bytes_ = 0;
+	for (auto& frame : sending_)
+		send_bytes_ += frame->size();
+
+	boost::system::error_code ignored_ec;
+	socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
+	socket_.close(ignored_ec);
 }
 
 std::string connection::to_string()
 {
 	return connection_str_;
 }
+
+const overflow_counters& connection::overflow_stats()
+{
+	return overflow_counters_;
+}
@@ -12,53 +12,168 @@
 #define CONNECTION_HPP
 
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <memory>
 #include <boost/asio.hpp>
-#include <boost/asio/spawn.hpp>
+#include <boost/asio/coroutine.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include "auth_message.hpp"
+#include "msg_trace.hpp"
+#include "auth_config.hpp"
 
 
 class server;
 class auth_group;
+
+//How often the send queue overflow policies were applied, summed over all connections
+struct overflow_counters
+{
+	std::atomic<uint64_t> dropped_{0};      //msgs dropped as the oldest
+	std::atomic<uint64_t> collapsed_{0};    //msgs replaced by a newer msg of the same mac
+	std::atomic<uint64_t> disconnected_{0}; //connections closed as slow consumers
+};
+
 // Represents a single connection from a client.
+// The read loop is a stackless coroutine, an idle connection keeps no stack,
+// only its members and the buffers trimmed between msgs. It waits for the
+// socket to be readable, then reads as much as a pooled receive block holds and
+// handles every complete frame in it; the block goes back to the pool once all
+// its bytes are parsed.
 class connection
 	: public std::enable_shared_from_this<connection>,
+	  private boost::asio::coroutine,
 	  private boost::noncopyable
 {
 public:
-	// Construct a connection with the given socket.
-	connection(boost::asio::ip::tcp::socket socket, server* server);
+	// Construct a connection with the given socket, running on the given io_service.
+	connection(boost::asio::ip::tcp::socket socket, boost::asio::io_service& io_service, server* server);
+	~connection();
 
 	// Start the first asynchronous operation for the connection.
 	void start();
 
-	//Authentication information sent by the same group of other connections
-	void deliver(const auth_info& auth);
-	void do_send_auth_msg(const auth_info& auth);
+	//Frames sent by the same group of other connections, encoded once for every participant
+	void deliver(frame_list_ptr frames);
+
+	//The encoding this client receives, valid once it has joined its group
+	uint8_t wire_version() const;
+	bool accepts_batch() const;
 
 	std::string to_string();
 
+	static const overflow_counters& overflow_stats();
+
 private:
 
-	void do_process(boost::asio::yield_context yield);
+	//The read loop, resumed in the strand by every read or write of it completing
+	void do_process(const boost::system::error_code& ec = boost::system::error_code());
+
+	//Leave the group, close the socket and stop the timer, the loop has ended. A loop that ended as it should,
+	//such as after a redirect, isn't logged as an error
+	void finish(const std::string& reason, bool failed = true);
+
+	//Read what the socket has into the receive block without waiting
+	void read_some();
+
+	//Take the next complete frame off the receive block, false when there is none.
+	//A frame larger than the block is moved to auth_message::recv_body_ and large_frame_ set
+	bool next_frame();
+
+	//Dispatch the frame whose header and body auth_message_ holds
+	void handle_frame();
+
+	//A REDIRECT frame when another server owns the gid
+	frame_ptr do_check_client_response();
+
+	void do_auth_response();
+
+	void do_auth_batch();
+
+	void do_heartbeat();
+
+	//Apply the TCP keepalive options of the config to the socket
+	void set_keepalive();
 
-	void do_check_client_response(boost::asio::yield_context& yield);
+	//One timer for the handshake deadline, then for the heartbeat and the idle deadline.
+	//Every header read restarts the idle time
+	void arm_deadline(std::chrono::steady_clock::duration after);
+	void arm_idle_deadline();
+	void handle_deadline(const boost::system::error_code& ec);
 
-	void do_auth_response(boost::asio::yield_context& yield);
+	//Time since the client was last heard from. A client without CAP_HEARTBEAT isn't pinged,
+	//the acks of its TCP stack count as well, keepalive probes included
+	std::chrono::steady_clock::duration silence();
+
+	//Queue a frame for sending, runs in the strand
+	void do_deliver(frame_list_ptr frames);
+	void enqueue(const keyed_frame& frame);
+
+	//Apply the overflow policy until the limits hold again, false if the connection is closed
+	bool handle_overflow(std::size_t incoming_bytes);
+	void collapse_send_queue();
+	void close();
+
+	//Gather the queued frames into one write, only one write is in flight
+	void do_write();
+	void handle_write(const boost::system::error_code& ec);
 
 	//Whether the client has passed the authentication
 	bool certified_ = false;
 
-	//Authentication string
-	std::string chap_req_;
+	//Sent instead of joining when another server owns the gid
+	frame_ptr redirect_;
+
+	//The pooled receive block, null while there are no unparsed bytes.
+	//[recv_begin_, recv_end_) is received and not parsed yet
+	char* recv_buf_ = nullptr;
+	std::size_t recv_begin_ = 0;
+	std::size_t recv_end_ = 0;
+
+	//The last read filled the block, the socket may have more
+	bool recv_full_ = false;
+
+	//Bytes of a frame larger than the block already in auth_message::recv_body_
+	std::size_t large_have_ = 0;
+	bool large_frame_ = false;
+
+	boost::asio::steady_timer deadline_;
+
+	//When the last header was read, and whether it has been pinged since
+	std::chrono::steady_clock::time_point last_read_;
+	bool pinged_ = false;
+
+	//The trace of the msg being processed, when it is sampled
+	trace_ptr trace_;
+
 	std::string connection_str_;
 	// Socket for the connection.
 	boost::asio::ip::tcp::socket socket_;
 
 	// Strand to ensure the connection's handlers are not called concurrently.
+	// It belongs to the shard that accepted the socket.
 	boost::asio::io_service::strand strand_;
 
 	auth_message auth_message_;
+
+	//Frames waiting to be sent, and the frames of the write in flight
+	std::deque<keyed_frame> send_queue_;
+	std::vector<frame_ptr> sending_;
+	std::vector<trace_ptr> sending_traces_;
+	std::vector<boost::asio::const_buffer> write_buffers_;
+	std::size_t send_queue_max_;
+	std::size_t send_bytes_max_;
+	Overflow_Policy overflow_policy_;
+
+	//Bytes queued or in flight
+	std::size_t send_bytes_ = 0;
+
+	//Set from the first overflow until the queue drains, to log once per episode
+	bool overflowed_ = false;
+
+	static overflow_counters overflow_counters_;
+
 	//Which group its belongs to
 	auth_group *auth_group_;
 
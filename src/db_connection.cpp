@@ -0,0 +1,150 @@
+#include "db_connection.hpp"
+#include "auth_config.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+
+using namespace std;
+
+db_connection::db_connection(sql::Driver* driver, const string& url, const string& user, const string& password)
+	: conn_(driver->connect(url, user, password))
+{
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+
+	conn_->setSchema(config.db_database_);
+	load_.reset(conn_->prepareStatement("select gid,mac,attr,auth_time,duration from " + config.db_table_
+		+ " where gid % ? = ? and (gid > ? or (gid = ? and mac > ?)) and auth_time + duration > ? order by gid,mac limit ?"));
+	purge_.reset(conn_->prepareStatement("delete from " + config.db_table_ + " where auth_time + duration <= ? limit ?"));
+	replace(1);
+	replace(config.db_batch_max_);
+	erase(1);
+	erase(config.db_batch_max_);
+}
+
+db_connection::~db_connection()
+{
+	replace_.clear();
+	erase_.clear();
+	load_.reset();
+	purge_.reset();
+	try
+	{
+		conn_->close();
+	}
+	catch (std::exception&)
+	{
+	}
+}
+
+bool db_connection::closed()
+{
+	return conn_->isClosed();
+}
+
+bool db_connection::valid()
+{
+	return conn_->isValid();
+}
+
+size_t db_connection::rows(size_t n)
+{
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+
+	size_t r = 1;
+	while (r < n)
+		r <<= 1;
+	return min<size_t>(r, max<size_t>(config.db_batch_max_, 1));
+}
+
+sql::PreparedStatement& db_connection::replace(size_t n)
+{
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+
+	return cached(replace_, rows(n), "replace into " + config.db_table_ + " (mac,attr,gid,auth_time,duration) values ",
+		"(?,?,?,?,?)", "");
+}
+
+sql::PreparedStatement& db_connection::erase(size_t n)
+{
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+
+	return cached(erase_, rows(n), "delete from " + config.db_table_ + " where (gid,mac) in (", "(?,?)", ")");
+}
+
+sql::PreparedStatement& db_connection::load()
+{
+	return *load_;
+}
+
+sql::PreparedStatement& db_connection::purge()
+{
+	return *purge_;
+}
+
+void db_connection::begin()
+{
+	suspect_ = true;
+	conn_->setAutoCommit(false);
+}
+
+void db_connection::commit()
+{
+	conn_->commit();
+	conn_->setAutoCommit(true);
+	suspect_ = false;
+}
+
+int db_connection::execute_update(sql::PreparedStatement& stmt)
+{
+	bool was = suspect_;
+	suspect_ = true;
+	auto start = chrono::steady_clock::now();
+	int rows = stmt.executeUpdate();
+	metrics::observe(DB_QUERY_US, chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count());
+	suspect_ = was;
+	return rows;
+}
+
+sql::ResultSet* db_connection::execute_query(sql::PreparedStatement& stmt)
+{
+	bool was = suspect_;
+	suspect_ = true;
+	auto start = chrono::steady_clock::now();
+	sql::ResultSet* res = stmt.executeQuery();
+	metrics::observe(DB_QUERY_US, chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count());
+	suspect_ = was;
+	return res;
+}
+
+bool db_connection::recover()
+{
+	try
+	{
+		conn_->rollback();
+		conn_->setAutoCommit(true);
+		suspect_ = !conn_->isValid();
+	}
+	catch (std::exception&)
+	{
+		return false;
+	}
+	return !suspect_;
+}
+
+sql::PreparedStatement& db_connection::cached(statement_cache& cache, size_t n, const string& head,
+	const string& row, const string& tail)
+{
+	auto it = cache.find(n);
+	if (it == cache.end())
+	{
+		string sql = head;
+		for (size_t i = 0; i < n; i++)
+		{
+			if (i)
+				sql += ',';
+			sql += row;
+		}
+		sql += tail;
+		it = cache.emplace(n, unique_ptr<sql::PreparedStatement>(conn_->prepareStatement(sql))).first;
+	}
+	return *it->second;
+}
@@ -0,0 +1,77 @@
+#ifndef DB_CONNECTION_HPP
+#define DB_CONNECTION_HPP
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mysql_connection.h>
+#include <cppconn/driver.h>
+#include <cppconn/connection.h>
+#include <cppconn/prepared_statement.h>
+#include <boost/noncopyable.hpp>
+
+//A pooled MySQL connection with its schema selected and its statements prepared once.
+//Multi-row statements are prepared for power of two row counts up to db_batch_max,
+//callers pad a batch up to rows() by repeating its last row.
+class db_connection
+	: private boost::noncopyable
+{
+public:
+	//The sql::SQLException may be thrown out
+	db_connection(sql::Driver* driver, const std::string& url, const std::string& user, const std::string& password);
+	~db_connection();
+
+	bool closed();
+
+	//Ping the server
+	bool valid();
+
+	//Row count of the statement that takes n rows
+	static std::size_t rows(std::size_t n);
+
+	//replace into table (mac,attr,gid,auth_time,duration) values (?,?,?,?,?)...
+	sql::PreparedStatement& replace(std::size_t n);
+
+	//delete from table where (gid,mac) in ((?,?)...)
+	sql::PreparedStatement& erase(std::size_t n);
+
+	//One page of the live rows of a gid partition after a (gid, mac) cursor:
+	//select gid,mac,attr,auth_time,duration from table where gid % ? = ? and (gid,mac) > (?,?)
+	//and auth_time + duration > ? order by gid,mac limit ?
+	sql::PreparedStatement& load();
+
+	//delete from table where auth_time + duration <= ? limit ?
+	sql::PreparedStatement& purge();
+
+	//The statements run between begin() and commit() take effect together, a connection
+	//closed in between drops them
+	void begin();
+	void commit();
+
+	//Run a statement of this connection, its latency goes to DB_QUERY_US. A statement or
+	//commit that throws leaves the connection suspect until recover()
+	int execute_update(sql::PreparedStatement& stmt);
+	sql::ResultSet* execute_query(sql::PreparedStatement& stmt);
+
+	bool suspect() const { return suspect_; }
+
+	//Drop an unfinished transaction and ping the server, false if the connection is lost
+	bool recover();
+
+private:
+	typedef std::map<std::size_t, std::unique_ptr<sql::PreparedStatement> > statement_cache;
+
+	sql::PreparedStatement& cached(statement_cache& cache, std::size_t n, const std::string& head,
+		const std::string& row, const std::string& tail);
+
+	std::unique_ptr<sql::Connection> conn_;
+
+	statement_cache replace_;
+	statement_cache erase_;
+	std::unique_ptr<sql::PreparedStatement> load_;
+	std::unique_ptr<sql::PreparedStatement> purge_;
+
+	bool suspect_ = false;
+};
+
+#endif
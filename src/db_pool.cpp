@@ -0,0 +1,264 @@
+#include "db_pool.hpp"
+#include <exception>
+#include <stdexcept>
+#include <mysql_driver.h>
+#include "async_log.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+const uint64_t db_pool_stats::wait_bounds_us[wait_buckets - 1] = { 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+
+db_pool_stats::db_pool_stats()
+{
+	for (auto& w : waits_)
+		w = 0;
+}
+
+db_pool::lease::lease(db_pool* pool, db_connection* conn)
+	: pool_(pool), conn_(conn)
+{
+}
+
+db_pool::lease::lease(lease&& other)
+	: pool_(other.pool_), conn_(other.conn_), broken_(other.broken_)
+{
+	other.conn_ = nullptr;
+}
+
+db_pool::lease::~lease()
+{
+	if (conn_)
+		pool_->release(conn_, broken_);
+}
+
+db_pool::db_pool(const string& url, const string& user, const string& password,
+	size_t min, size_t max, seconds check_interval, seconds idle_timeout)
+	: driver_(sql::mysql::get_driver_instance()),
+	url_(url), user_(user), password_(password),
+	min_(min), max_(std::max<size_t>(max, std::max<size_t>(min, 1))),
+	check_interval_(check_interval), idle_timeout_(idle_timeout)
+{
+	//Owned until every connection is made, a failed connect throws out of the constructor
+	vector<unique_ptr<db_connection> > made;
+	for (size_t i = 0; i < min_; i++)
+		made.emplace_back(create());
+	for (auto& conn : made)
+		idle_.push_back(idle_conn{ conn.release(), steady_clock::now() });
+	size_ = idle_.size();
+	stats_.idle_ = idle_.size();
+
+	checker_ = thread(&db_pool::run, this);
+}
+
+db_pool::~db_pool()
+{
+	{
+		lock_guard<mutex> lock(mutex_);
+		stopped_ = true;
+	}
+	stop_cond_.notify_all();
+	cond_.notify_all();
+	checker_.join();
+
+	for (auto& idle : idle_)
+		destroy(idle.conn_);
+}
+
+db_pool::lease db_pool::acquire(milliseconds timeout)
+{
+	auto start = steady_clock::now();
+	auto deadline = start + timeout;
+	db_connection* conn = nullptr;
+
+	unique_lock<mutex> lock(mutex_);
+	while (!conn)
+	{
+		if (stopped_)
+			throw runtime_error("database pool stopped");
+
+		if (!idle_.empty())
+		{
+			conn = idle_.back().conn_;
+			idle_.pop_back();
+			stats_.idle_ = idle_.size();
+
+			//A statement of its last lease threw, it may have lost the server
+			lock.unlock();
+			bool usable = !conn->closed() && (!conn->suspect() || conn->recover());
+			if (!usable)
+			{
+				AUTH_LOG(warning) << "database connection discarded";
+				destroy(conn);
+				conn = nullptr;
+			}
+			lock.lock();
+			if (!usable)
+			{
+				size_--;
+				cond_.notify_one();
+			}
+			continue;
+		}
+
+		if (size_ < max_)
+		{
+			//Connect without the lock, the slot is taken meanwhile
+			size_++;
+			lock.unlock();
+			try
+			{
+				conn = create();
+			}
+			catch (...)
+			{
+				lock.lock();
+				size_--;
+				cond_.notify_one();
+				throw;
+			}
+			lock.lock();
+			continue;
+		}
+
+		if (cond_.wait_until(lock, deadline) == cv_status::timeout && idle_.empty() && size_ >= max_)
+		{
+			stats_.timeouts_++;
+			record_wait(steady_clock::now() - start);
+			throw runtime_error("wait for database connection timeout");
+		}
+	}
+	lock.unlock();
+
+	record_wait(steady_clock::now() - start);
+	return lease(this, conn);
+}
+
+const db_pool_stats& db_pool::stats() const
+{
+	return stats_;
+}
+
+db_connection* db_pool::create()
+{
+	db_connection* conn = new db_connection(driver_, url_, user_, password_);
+	stats_.created_++;
+	stats_.size_++;
+	return conn;
+}
+
+void db_pool::destroy(db_connection* conn)
+{
+	delete conn;
+	stats_.destroyed_++;
+	stats_.size_--;
+}
+
+void db_pool::release(db_connection* conn, bool broken)
+{
+	{
+		lock_guard<mutex> lock(mutex_);
+		if (!broken && !stopped_)
+		{
+			idle_.push_back(idle_conn{ conn, steady_clock::now() });
+			stats_.idle_ = idle_.size();
+			cond_.notify_one();
+			return;
+		}
+		size_--;
+		cond_.notify_one();
+	}
+
+	AUTH_LOG(warning) << "database connection discarded";
+	destroy(conn);
+}
+
+void db_pool::record_wait(steady_clock::duration wait)
+{
+	uint64_t us = duration_cast<microseconds>(wait).count();
+
+	size_t i = 0;
+	while (i < db_pool_stats::wait_buckets - 1 && us > db_pool_stats::wait_bounds_us[i])
+		i++;
+	stats_.waits_[i]++;
+}
+
+void db_pool::run()
+{
+	unique_lock<mutex> lock(mutex_);
+	while (!stopped_)
+	{
+		if (stop_cond_.wait_for(lock, check_interval_) == cv_status::no_timeout)
+			continue;
+
+		lock.unlock();
+		check();
+		lock.lock();
+	}
+}
+
+void db_pool::check()
+{
+	vector<idle_conn> checking;
+	size_t keep;
+	{
+		lock_guard<mutex> lock(mutex_);
+		checking.swap(idle_);
+		stats_.idle_ = 0;
+		keep = size_ > checking.size() ? size_ - checking.size() : 0;
+	}
+
+	//Ping the idle connections without the lock, oldest first go when above min
+	vector<idle_conn> alive;
+	size_t dropped = 0;
+	auto now = steady_clock::now();
+	for (auto& idle : checking)
+	{
+		bool ok;
+		try
+		{
+			ok = idle.conn_->valid();
+		}
+		catch (std::exception& e)
+		{
+			ok = false;
+		}
+
+		if (ok && (now - idle.since_ < idle_timeout_ || keep + alive.size() < min_))
+		{
+			alive.push_back(idle);
+			continue;
+		}
+		if (!ok)
+			AUTH_LOG(warning) << "database connection failed the health check";
+		destroy(idle.conn_);
+		dropped++;
+	}
+
+	//Top up to min with fresh connections
+	size_t missing;
+	{
+		lock_guard<mutex> lock(mutex_);
+		size_ -= dropped;
+		missing = size_ < min_ ? min_ - size_ : 0;
+		size_ += missing;
+	}
+	for (size_t i = 0; i < missing; i++)
+	{
+		try
+		{
+			alive.push_back(idle_conn{ create(), steady_clock::now() });
+		}
+		catch (std::exception& e)
+		{
+			AUTH_LOG(error) << "connect to database error " << e.what();
+			lock_guard<mutex> lock(mutex_);
+			size_--;
+		}
+	}
+
+	lock_guard<mutex> lock(mutex_);
+	idle_.insert(idle_.begin(), alive.begin(), alive.end());
+	stats_.idle_ = idle_.size();
+	cond_.notify_all();
+}
@@ -0,0 +1,109 @@
+#ifndef DB_POOL_HPP
+#define DB_POOL_HPP
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <boost/noncopyable.hpp>
+#include "db_connection.hpp"
+
+struct db_pool_stats
+{
+	//Upper bounds of the wait histogram buckets in microseconds, the last bucket is unbounded
+	static const std::size_t wait_buckets = 8;
+	static const uint64_t wait_bounds_us[wait_buckets - 1];
+
+	std::atomic<uint64_t> size_{0};		//connections open, idle or leased
+	std::atomic<uint64_t> idle_{0};
+	std::atomic<uint64_t> created_{0};
+	std::atomic<uint64_t> destroyed_{0};	//broken, failed the health check or idle too long
+	std::atomic<uint64_t> timeouts_{0};	//acquires that gave up waiting
+	std::atomic<uint64_t> waits_[wait_buckets];
+
+	db_pool_stats();
+};
+
+//Pool of db_connection between min and max connections. acquire() hands out a
+//lease that goes back to the pool when it is destroyed; a connection whose last
+//statement threw is pinged before it is leased again. When every connection is leased acquire()
+//waits until one comes back or its deadline passes. A background thread pings
+//the idle connections, replaces the broken ones and closes the ones idle too
+//long above min.
+class db_pool
+	: private boost::noncopyable
+{
+public:
+	class lease
+	{
+	public:
+		lease(lease&& other);
+		~lease();
+
+		db_connection* operator->() const { return conn_; }
+		db_connection& operator*() const { return *conn_; }
+
+		//Don't give the connection back, it is broken
+		void invalidate() { broken_ = true; }
+
+	private:
+		friend class db_pool;
+		lease(db_pool* pool, db_connection* conn);
+		lease(const lease&) = delete;
+		lease& operator=(const lease&) = delete;
+
+		db_pool* pool_;
+		db_connection* conn_;
+		bool broken_ = false;
+	};
+
+	//The sql::SQLException may be thrown out when the min connections can't be made
+	db_pool(const std::string& url, const std::string& user, const std::string& password,
+		std::size_t min, std::size_t max, std::chrono::seconds check_interval, std::chrono::seconds idle_timeout);
+	~db_pool();
+
+	//A connection within timeout, throws when none is free in time or a new one fails
+	lease acquire(std::chrono::milliseconds timeout);
+
+	const db_pool_stats& stats() const;
+
+private:
+	struct idle_conn
+	{
+		db_connection* conn_;
+		std::chrono::steady_clock::time_point since_;
+	};
+
+	db_connection* create();
+	void destroy(db_connection* conn);
+	void release(db_connection* conn, bool broken);
+	void record_wait(std::chrono::steady_clock::duration wait);
+
+	//Health check thread
+	void run();
+	void check();
+
+	sql::Driver* driver_;     //sql driver (the sql will free it)
+	std::string url_;
+	std::string user_;
+	std::string password_;
+	std::size_t min_;
+	std::size_t max_;
+	std::chrono::seconds check_interval_;
+	std::chrono::seconds idle_timeout_;
+
+	std::vector<idle_conn> idle_;//most recently used last
+	std::size_t size_ = 0;//connections made and being made
+	bool stopped_ = false;
+	std::mutex mutex_;
+	std::condition_variable cond_;//a connection came back or a slot freed
+	std::condition_variable stop_cond_;
+	std::thread checker_;
+
+	db_pool_stats stats_;
+};
+
+#endif
@@ -0,0 +1,232 @@
+#include "db_writer.hpp"
+#include <algorithm>
+#include "async_log.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+const milliseconds db_writer::retry_min(100);
+const milliseconds db_writer::retry_max(5000);
+
+db_writer::db_writer(size_t threads, size_t batch_max, milliseconds flush_interval,
+	size_t queue_max, flush_handler handler)
+	: batch_max_(max<size_t>(batch_max, 1)),
+	flush_interval_(flush_interval),
+	handler_(handler)
+{
+	threads = max<size_t>(threads, 1);
+	partition_max_ = max<size_t>(queue_max / threads, 1);
+
+	for (size_t i = 0; i < threads; i++)
+		partitions_.emplace_back(new partition);
+	for (auto& p : partitions_)
+		p->thread_ = thread(&db_writer::run, this, ref(*p));
+}
+
+db_writer::~db_writer()
+{
+	stop();
+}
+
+size_t db_writer::row_hash::operator()(const pair<unsigned, uint64_t>& row) const
+{
+	uint64_t h = (row.second ^ (uint64_t(row.first) << 49 | row.first >> 15)) * 0x9E3779B97F4A7C15ull;
+	return static_cast<size_t>(h ^ (h >> 29));
+}
+
+db_writer::partition& db_writer::partition_of(unsigned gid, uint64_t mac)
+{
+	return *partitions_[row_hash()(make_pair(gid, mac)) % partitions_.size()];
+}
+
+void db_writer::replace(unsigned gid, const auth_info& auth)
+{
+	db_op op{ gid, auth_message::mac_key(auth.mac_) & mac_mask, false, auth, steady_clock::now() };
+	partition& p = partition_of(gid, op.mac_);
+
+	lock_guard<mutex> lock(p.mutex_);
+	push(p, move(op));
+}
+
+void db_writer::replace(unsigned gid, const vector<auth_info>& auths)
+{
+	auto now = steady_clock::now();
+
+	for (auto& auth : auths)
+	{
+		db_op op{ gid, auth_message::mac_key(auth.mac_) & mac_mask, false, auth, now };
+		partition& p = partition_of(gid, op.mac_);
+
+		lock_guard<mutex> lock(p.mutex_);
+		push(p, move(op));
+	}
+}
+
+void db_writer::erase(const vector<pair<unsigned, uint64_t> >& rows)
+{
+	auto now = steady_clock::now();
+
+	for (auto& row : rows)
+	{
+		partition& p = partition_of(row.first, row.second);
+
+		lock_guard<mutex> lock(p.mutex_);
+		push(p, db_op{ row.first, row.second, true, auth_info(), now });
+	}
+}
+
+void db_writer::push(partition& p, db_op&& op)
+{
+	auto it = p.pending_.find(make_pair(op.gid_, op.mac_));
+	if (it != p.pending_.end())
+	{
+		//The latest op of a row wins, the latency counts from the first one
+		op.queued_ = it->second.queued_;
+		it->second = move(op);
+		stats_.collapsed_++;
+		return;
+	}
+
+	if (p.pending_.size() >= partition_max_)
+	{
+		stats_.dropped_++;
+		if (!p.full_)
+		{
+			p.full_ = true;
+			AUTH_LOG(error) << "database write queue full, dropping writes";
+		}
+		return;
+	}
+
+	if (p.pending_.empty())
+		p.oldest_ = op.queued_;
+	p.pending_.emplace(make_pair(op.gid_, op.mac_), move(op));
+	stats_.queued_++;
+
+	if (p.pending_.size() == 1 || p.pending_.size() == batch_max_)
+		p.cond_.notify_one();
+}
+
+void db_writer::stop()
+{
+	for (auto& p : partitions_)
+	{
+		lock_guard<mutex> lock(p->mutex_);
+		stopped_ = true;
+		p->cond_.notify_one();
+	}
+	for (auto& p : partitions_)
+	{
+		if (p->thread_.joinable())
+			p->thread_.join();
+	}
+}
+
+const db_writer_stats& db_writer::stats() const
+{
+	return stats_;
+}
+
+void db_writer::run(partition& p)
+{
+	vector<db_op> batch;
+	milliseconds backoff = retry_min;
+	unique_lock<mutex> lock(p.mutex_);
+
+	for (;;)
+	{
+		if (p.pending_.empty())
+		{
+			if (stopped_)
+				break;
+			p.cond_.wait(lock);
+			continue;
+		}
+
+		auto deadline = p.oldest_ + flush_interval_;
+		if (!stopped_ && p.pending_.size() < batch_max_ && steady_clock::now() < deadline)
+		{
+			p.cond_.wait_until(lock, deadline);
+			continue;
+		}
+
+		//Take at most batch_max ops, the rest keep their oldest_ and go next round
+		batch.clear();
+		for (auto it = p.pending_.begin(); it != p.pending_.end() && batch.size() < batch_max_;)
+		{
+			batch.push_back(move(it->second));
+			it = p.pending_.erase(it);
+		}
+		p.full_ = false;
+		stats_.queued_ -= batch.size();
+
+		lock.unlock();
+		bool ok = flush(batch);
+		lock.lock();
+
+		if (ok)
+		{
+			backoff = retry_min;
+		}
+		else if (stopped_)
+		{
+			stats_.lost_ += batch.size();
+			AUTH_LOG(error) << "database write failed on stop, " << batch.size() << " records lost";
+		}
+		else
+		{
+			//Keep the batch and back off until the database is back
+			requeue(p, batch);
+			auto retry_at = steady_clock::now() + backoff;
+			while (!stopped_ && p.cond_.wait_until(lock, retry_at) == cv_status::no_timeout);
+			backoff = min(backoff * 2, retry_max);
+		}
+	}
+}
+
+void db_writer::requeue(partition& p, vector<db_op>& batch)
+{
+	for (auto& op : batch)
+	{
+		//A newer op of the row queued meanwhile wins
+		auto it = p.pending_.find(make_pair(op.gid_, op.mac_));
+		if (it != p.pending_.end())
+		{
+			it->second.queued_ = op.queued_;
+			stats_.collapsed_++;
+			continue;
+		}
+
+		if (p.pending_.empty() || op.queued_ < p.oldest_)
+			p.oldest_ = op.queued_;
+		p.pending_.emplace(make_pair(op.gid_, op.mac_), move(op));
+		stats_.queued_++;
+	}
+}
+
+bool db_writer::flush(vector<db_op>& batch)
+{
+	auto oldest = min_element(batch.begin(), batch.end(),
+		[](const db_op& a, const db_op& b) { return a.queued_ < b.queued_; })->queued_;
+
+	if (!handler_(batch))
+	{
+		stats_.failed_ += batch.size();
+		return false;
+	}
+
+	uint64_t latency = duration_cast<microseconds>(steady_clock::now() - oldest).count();
+	stats_.batches_++;
+	stats_.rows_ += batch.size();
+	stats_.last_batch_ = batch.size();
+	stats_.last_latency_us_ = latency;
+
+	uint64_t peak = stats_.max_batch_;
+	while (batch.size() > peak && !stats_.max_batch_.compare_exchange_weak(peak, batch.size()));
+	peak = stats_.max_latency_us_;
+	while (latency > peak && !stats_.max_latency_us_.compare_exchange_weak(peak, latency));
+
+	AUTH_LOG(debug) << "database flush " << batch.size() << " rows in " << latency << "us, "
+		<< stats_.queued_ << " queued";
+	return true;
+}
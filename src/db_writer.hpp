@@ -0,0 +1,112 @@
+#ifndef DB_WRITER_HPP
+#define DB_WRITER_HPP
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <boost/noncopyable.hpp>
+#include "auth_message.hpp"
+#include "mac_table.hpp"
+
+//A pending write of one (gid, mac) row, either a replace with auth_ or a delete
+struct db_op
+{
+	unsigned gid_;
+	uint64_t mac_;//mac of the row in the low 48 bits, as the expiry entries carry it
+	bool erase_;
+	auth_info auth_;
+	std::chrono::steady_clock::time_point queued_;
+};
+
+struct db_writer_stats
+{
+	std::atomic<uint64_t> queued_{0};		//ops waiting now
+	std::atomic<uint64_t> collapsed_{0};	//ops replaced by a later one of the same row
+	std::atomic<uint64_t> dropped_{0};		//ops refused because the queue was full
+	std::atomic<uint64_t> batches_{0};
+	std::atomic<uint64_t> rows_{0};
+	std::atomic<uint64_t> failed_{0};		//rows of the batches the database refused, they are retried
+	std::atomic<uint64_t> lost_{0};		//rows still failing when the writer stopped
+	std::atomic<uint64_t> last_batch_{0};
+	std::atomic<uint64_t> max_batch_{0};
+	std::atomic<uint64_t> last_latency_us_{0};//oldest op of the last batch queued until written
+	std::atomic<uint64_t> max_latency_us_{0};
+};
+
+//Write-behind queue in front of the database. Ops are partitioned by row over
+//the worker threads; a worker collapses repeated ops of a row and hands its
+//batch to the flush handler when it holds batch_max ops or its oldest op has
+//waited flush_interval. Producers never block: when the queue is full new
+//rows are dropped and counted. A batch the database refuses is queued again
+//and its partition backs off, so a database brownout delays writes but
+//doesn't lose them.
+class db_writer
+	: private boost::noncopyable
+{
+public:
+	typedef std::function<bool(const std::vector<db_op>&)> flush_handler;
+
+	db_writer(std::size_t threads, std::size_t batch_max, std::chrono::milliseconds flush_interval,
+		std::size_t queue_max, flush_handler handler);
+	~db_writer();
+
+	//Queue ops, called from any thread
+	void replace(unsigned gid, const auth_info& auth);
+	void replace(unsigned gid, const std::vector<auth_info>& auths);
+	void erase(const std::vector<std::pair<unsigned, uint64_t> >& rows);
+
+	//Write what is queued and stop the workers
+	void stop();
+
+	const db_writer_stats& stats() const;
+
+private:
+	struct row_hash
+	{
+		std::size_t operator()(const std::pair<unsigned, uint64_t>& row) const;
+	};
+
+	typedef std::unordered_map<std::pair<unsigned, uint64_t>, db_op, row_hash> op_map;
+
+	struct partition
+	{
+		std::mutex mutex_;
+		std::condition_variable cond_;
+		op_map pending_;
+		std::chrono::steady_clock::time_point oldest_;
+		bool full_ = false;//one log line per overflow
+		std::thread thread_;
+	};
+
+	partition& partition_of(unsigned gid, uint64_t mac);
+
+	//Queue one op, partition locked
+	void push(partition& p, db_op&& op);
+
+	void run(partition& p);
+	bool flush(std::vector<db_op>& batch);
+
+	//Put a failed batch back, partition locked
+	void requeue(partition& p, std::vector<db_op>& batch);
+
+	static const std::chrono::milliseconds retry_min;
+	static const std::chrono::milliseconds retry_max;
+
+	std::vector<std::unique_ptr<partition> > partitions_;
+	std::size_t batch_max_;
+	std::chrono::milliseconds flush_interval_;
+	std::size_t partition_max_;
+	flush_handler handler_;
+	std::atomic<bool> stopped_{false};
+
+	db_writer_stats stats_;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include <ctime>
+#include "async_log.hpp"
+#include "expiry_wheel.hpp"
+
+using namespace std;
+
+expiry_wheel::expiry_wheel(boost::asio::io_service& io_service, expire_handler handler)
+	: current_(static_cast<uint32_t>(time(NULL))),
+	timer_(io_service),
+	handler_(handler)
+{
+	wheels_[0].resize(1 << level0_bits);
+	for (unsigned level = 1; level < levels; level++)
+		wheels_[level].resize(1 << level_bits);
+}
+
+void expiry_wheel::add(const expiry_entry& entry)
+{
+	lock_guard<mutex> lock(mutex_);
+	place(entry);
+}
+
+void expiry_wheel::start()
+{
+	timer_.expires_from_now(std::chrono::seconds(1));
+	timer_.async_wait(std::bind(&expiry_wheel::handle_tick, this, std::placeholders::_1));
+}
+
+void expiry_wheel::handle_tick(const boost::system::error_code& ec)
+{
+	if (ec)
+		return;
+
+	vector<expiry_entry> expired;
+	{
+		lock_guard<mutex> lock(mutex_);
+		advance(static_cast<uint32_t>(time(NULL)), expired);
+	}
+
+	if (!expired.empty())
+	{
+		try
+		{
+			handler_(expired);
+		}
+		catch (std::exception& e)
+		{
+			AUTH_LOG(error) << "expire records error:" << e.what();
+		}
+	}
+
+	start();
+}
+
+void expiry_wheel::advance(uint32_t now, vector<expiry_entry>& expired)
+{
+	while (static_cast<int32_t>(now - current_) > 0)
+	{
+		++current_;
+
+		//At the start of a turn pull the next slot of every higher level down
+		uint32_t index = current_ & ((1 << level0_bits) - 1);
+		for (unsigned level = 1; level < levels && index == 0; level++)
+		{
+			cascade(level);
+			index = (current_ >> (level0_bits + level_bits * (level - 1))) & ((1 << level_bits) - 1);
+		}
+
+		vector<expiry_entry> slot;
+		slot.swap(wheels_[0][current_ & ((1 << level0_bits) - 1)]);
+		for (auto& entry : slot)
+		{
+			if (static_cast<int32_t>(entry.expire_at_ - current_) <= 0)
+				expired.push_back(entry);
+			else
+				place(entry);
+		}
+	}
+
+	//Added or cascaded down when already due
+	expired.insert(expired.end(), overdue_.begin(), overdue_.end());
+	overdue_.clear();
+}
+
+void expiry_wheel::cascade(unsigned level)
+{
+	unsigned shift = level0_bits + level_bits * (level - 1);
+	vector<expiry_entry> slot;
+	slot.swap(wheels_[level][(current_ >> shift) & ((1 << level_bits) - 1)]);
+	for (auto& entry : slot)
+		place(entry);
+}
+
+void expiry_wheel::place(const expiry_entry& entry)
+{
+	int64_t delta = static_cast<int64_t>(entry.expire_at_) - current_;
+	if (delta <= 0)
+	{
+		overdue_.push_back(entry);
+		return;
+	}
+
+	if (delta < (1 << level0_bits))
+	{
+		wheels_[0][entry.expire_at_ & ((1 << level0_bits) - 1)].push_back(entry);
+		return;
+	}
+
+	//Entries beyond the top level wait in its farthest slot and are placed again from there
+	uint32_t when = entry.expire_at_;
+	for (unsigned level = 1; level < levels; level++)
+	{
+		unsigned shift = level0_bits + level_bits * level;
+		if (delta < (int64_t(1) << shift) || level == levels - 1)
+		{
+			if (delta >= (int64_t(1) << shift))
+				when = current_ + (uint32_t(1) << shift) - 1;
+
+			shift -= level_bits;
+			wheels_[level][(when >> shift) & ((1 << level_bits) - 1)].push_back(entry);
+			return;
+		}
+	}
+}
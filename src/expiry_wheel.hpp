@@ -0,0 +1,62 @@
+#ifndef EXPIRY_WHEEL_HPP
+#define EXPIRY_WHEEL_HPP
+
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/noncopyable.hpp>
+
+//A record that expires at expire_at_ (seconds since epoch)
+struct expiry_entry
+{
+	unsigned gid_;
+	uint32_t expire_at_;
+	uint64_t mac_;
+};
+
+//Hierarchical timing wheel with a one second tick, driven by a steady_timer.
+//Level 0 has 256 one second slots, every higher level has 64 slots each covering
+//a whole turn of the level below; slots cascade down as the wheel turns.
+class expiry_wheel
+	: private boost::noncopyable
+{
+public:
+	typedef std::function<void(std::vector<expiry_entry>&)> expire_handler;
+
+	expiry_wheel(boost::asio::io_service& io_service, expire_handler handler);
+
+	//Schedule an entry, called from any thread
+	void add(const expiry_entry& entry);
+
+	//Start ticking on the io_service
+	void start();
+
+private:
+	static const unsigned level0_bits = 8;
+	static const unsigned level_bits = 6;
+	static const unsigned levels = 4;
+
+	void handle_tick(const boost::system::error_code& ec);
+
+	//Turn the wheel up to now, collecting the due entries
+	void advance(uint32_t now, std::vector<expiry_entry>& expired);
+	void place(const expiry_entry& entry);
+	void cascade(unsigned level);
+
+	std::vector<std::vector<expiry_entry> > wheels_[levels];
+
+	//Entries due already when they were added
+	std::vector<expiry_entry> overdue_;
+
+	//The last second the wheel has turned to
+	uint32_t current_;
+
+	std::mutex mutex_;
+	boost::asio::steady_timer timer_;
+	expire_handler handler_;
+};
+
+#endif
@@ -0,0 +1,213 @@
+#include <vector>
+#include "async_log.hpp"
+#include "group_registry.hpp"
+#include "auth_group.hpp"
+
+using namespace std;
+
+group_registry::table::table(size_t capacity)
+	: mask_(capacity - 1),
+	slots_(new slot[capacity])
+{
+	for (size_t i = 0; i < capacity; i++)
+	{
+		slots_[i].gid_.store(0, memory_order_relaxed);
+		slots_[i].group_.store(nullptr, memory_order_relaxed);
+	}
+}
+
+group_registry::group_registry(group_factory factory)
+	: factory_(factory),
+	shards_(new shard[shard_count])
+{
+	for (size_t i = 0; i < shard_count; i++)
+		shards_[i].table_.store(new table(16));
+}
+
+group_registry::~group_registry()
+{
+	for (size_t i = 0; i < shard_count; i++)
+	{
+		table* t = shards_[i].table_.load();
+		for (size_t j = 0; j <= t->mask_; j++)
+		{
+			auth_group* group = t->slots_[j].group_.load();
+			if (group != nullptr && group != tombstone())
+				delete group;
+		}
+		delete t;
+	}
+
+	for (auto& r : retired_)
+	{
+		delete r.group_;
+		delete r.table_;
+	}
+}
+
+auth_group* group_registry::find(unsigned gid) const
+{
+	return probe(*shard_of(gid).table_.load(memory_order_acquire), gid);
+}
+
+auth_group& group_registry::get(unsigned gid)
+{
+	auth_group* group = find(gid);
+	if (group)
+		return *group;
+
+	shard& s = shard_of(gid);
+	lock_guard<mutex> lock(s.mutex_);
+
+	group = probe(*s.table_.load(memory_order_relaxed), gid);
+	if (!group)
+	{
+		group = factory_(gid);
+		insert(s, gid, group);
+	}
+	return *group;
+}
+
+void group_registry::reclaim(time_t grace)
+{
+	time_t now = time(NULL);
+	size_t count = 0;
+
+	for (size_t i = 0; i < shard_count; i++)
+	{
+		shard& s = shards_[i];
+		lock_guard<mutex> lock(s.mutex_);
+
+		table* t = s.table_.load(memory_order_relaxed);
+		for (size_t j = 0; j <= t->mask_; j++)
+		{
+			auth_group* group = t->slots_[j].group_.load(memory_order_relaxed);
+			if (group == nullptr || group == tombstone() || !group->retire())
+				continue;
+
+			t->slots_[j].group_.store(tombstone(), memory_order_release);
+			s.live_--;
+			count++;
+
+			lock_guard<mutex> retire_lock(retire_mutex_);
+			retired_.push_back(retired{ now, group, nullptr });
+		}
+	}
+
+	lock_guard<mutex> retire_lock(retire_mutex_);
+	while (!retired_.empty() && now - retired_.front().when_ >= grace)
+	{
+		delete retired_.front().group_;
+		delete retired_.front().table_;
+		retired_.pop_front();
+	}
+
+	if (count)
+		AUTH_LOG(info) << "reclaim " << count << " empty groups";
+}
+
+size_t group_registry::size() const
+{
+	size_t live = 0;
+	for (size_t i = 0; i < shard_count; i++)
+		live += shards_[i].live_;
+	return live;
+}
+
+void group_registry::for_each(const function<void(unsigned, auth_group&)>& visit)
+{
+	vector<pair<unsigned, auth_group*> > groups;
+
+	for (size_t i = 0; i < shard_count; i++)
+	{
+		groups.clear();
+		{
+			lock_guard<mutex> lock(shards_[i].mutex_);
+			table* t = shards_[i].table_.load(memory_order_relaxed);
+			for (size_t j = 0; j <= t->mask_; j++)
+			{
+				auth_group* group = t->slots_[j].group_.load(memory_order_relaxed);
+				if (group != nullptr && group != tombstone())
+					groups.push_back(make_pair(t->slots_[j].gid_.load(memory_order_relaxed), group));
+			}
+		}
+
+		for (auto& g : groups)
+			visit(g.first, *g.second);
+	}
+}
+
+auth_group* group_registry::tombstone()
+{
+	static auth_group* const t = reinterpret_cast<auth_group*>(static_cast<uintptr_t>(1));
+	return t;
+}
+
+size_t group_registry::hash(unsigned gid)
+{
+	uint64_t h = gid * 0x9E3779B97F4A7C15ull;
+	return static_cast<size_t>(h ^ (h >> 32));
+}
+
+group_registry::shard& group_registry::shard_of(unsigned gid) const
+{
+	return shards_[hash(gid) % shard_count];
+}
+
+auth_group* group_registry::probe(const table& t, unsigned gid)
+{
+	//Shards use the low bits of the hash, the table the high ones
+	for (size_t i = (hash(gid) >> 16) & t.mask_;; i = (i + 1) & t.mask_)
+	{
+		auth_group* group = t.slots_[i].group_.load(memory_order_acquire);
+		if (group == nullptr)
+			return nullptr;
+		if (group != tombstone() && t.slots_[i].gid_.load(memory_order_relaxed) == gid)
+			return group;
+	}
+}
+
+void group_registry::insert(shard& s, unsigned gid, auth_group* group)
+{
+	table* t = s.table_.load(memory_order_relaxed);
+
+	//Keep the used slots under half, rebuild without the reclaimed slots
+	if ((t->used_ + 1) * 2 > t->mask_ + 1)
+	{
+		size_t capacity = t->mask_ + 1;
+		while ((s.live_ + 1) * 4 > capacity)
+			capacity *= 2;
+
+		table* bigger = new table(capacity);
+		for (size_t j = 0; j <= t->mask_; j++)
+		{
+			auth_group* g = t->slots_[j].group_.load(memory_order_relaxed);
+			if (g == nullptr || g == tombstone())
+				continue;
+
+			unsigned id = t->slots_[j].gid_.load(memory_order_relaxed);
+			size_t i = (hash(id) >> 16) & bigger->mask_;
+			while (bigger->slots_[i].group_.load(memory_order_relaxed) != nullptr)
+				i = (i + 1) & bigger->mask_;
+			bigger->slots_[i].gid_.store(id, memory_order_relaxed);
+			bigger->slots_[i].group_.store(g, memory_order_relaxed);
+			bigger->used_++;
+		}
+
+		s.table_.store(bigger, memory_order_release);
+
+		lock_guard<mutex> retire_lock(retire_mutex_);
+		retired_.push_back(retired{ time(NULL), nullptr, t });
+		t = bigger;
+	}
+
+	size_t i = (hash(gid) >> 16) & t->mask_;
+	while (t->slots_[i].group_.load(memory_order_relaxed) != nullptr)
+		i = (i + 1) & t->mask_;
+
+	//Readers check the group first, so the gid must be visible before it
+	t->slots_[i].gid_.store(gid, memory_order_relaxed);
+	t->slots_[i].group_.store(group, memory_order_release);
+	t->used_++;
+	s.live_++;
+}
@@ -0,0 +1,91 @@
+#ifndef GROUP_REGISTRY_HPP
+#define GROUP_REGISTRY_HPP
+
+#include <atomic>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <boost/noncopyable.hpp>
+
+class auth_group;
+
+//gid -> auth_group, split into shards. Every shard is an open addressing table
+//that readers probe without a lock; only creating and reclaiming groups lock the shard.
+//Groups and replaced tables are freed after a grace period, so a reader never
+//sees freed memory.
+class group_registry
+	: private boost::noncopyable
+{
+public:
+	typedef std::function<auth_group*(unsigned gid)> group_factory;
+
+	explicit group_registry(group_factory factory);
+	~group_registry();
+
+	//The group of gid, nullptr if there is none
+	auth_group* find(unsigned gid) const;
+
+	//The group of gid, created when there is none
+	auth_group& get(unsigned gid);
+
+	//Retire the groups without participants and records, free what retired more than grace seconds ago
+	void reclaim(time_t grace);
+
+	//Number of live groups
+	std::size_t size() const;
+
+	//Visit every live group, without holding a shard lock. A group reclaimed meanwhile
+	//is still valid for the grace period, visit takes much less than that
+	void for_each(const std::function<void(unsigned gid, auth_group& group)>& visit);
+
+private:
+	static const std::size_t shard_count = 64;
+
+	struct slot
+	{
+		std::atomic<unsigned> gid_;
+		std::atomic<auth_group*> group_;//nullptr is empty, tombstone() was reclaimed
+	};
+
+	struct table
+	{
+		explicit table(std::size_t capacity);
+
+		std::size_t mask_;
+		std::unique_ptr<slot[]> slots_;
+		std::size_t used_ = 0;//live and reclaimed slots
+	};
+
+	struct shard
+	{
+		std::atomic<table*> table_;
+		std::mutex mutex_;
+		std::atomic<std::size_t> live_{0};
+	};
+
+	struct retired
+	{
+		time_t when_;
+		auth_group* group_;
+		table* table_;
+	};
+
+	static auth_group* tombstone();
+	static std::size_t hash(unsigned gid);
+
+	shard& shard_of(unsigned gid) const;
+	static auth_group* probe(const table& t, unsigned gid);
+
+	//Insert into the shard's table, growing it first when needed; shard locked
+	void insert(shard& s, unsigned gid, auth_group* group);
+
+	group_factory factory_;
+	std::unique_ptr<shard[]> shards_;
+
+	std::mutex retire_mutex_;
+	std::deque<retired> retired_;
+};
+
+#endif
@@ -0,0 +1,105 @@
+//
+// io_service_pool.cpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2003-2017 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include <stdexcept>
+#include "async_log.hpp"
+#include "io_service_pool.hpp"
+
+using namespace std;
+
+io_service_pool::io_service_pool(size_t thread_cnt, bool per_core, bool cpu_affinity)
+	: thread_cnt_(thread_cnt),
+	cpu_affinity_(cpu_affinity)
+{
+	if (thread_cnt == 0)
+	{
+		throw runtime_error("io_service_pool size is 0");
+	}
+
+	// Give all the io_services work to do so that their run() functions will not
+	// exit until they are explicitly stopped.
+	size_t pool_size = per_core ? thread_cnt : 1;
+	for (size_t i = 0; i < pool_size; ++i)
+	{
+		io_service_ptr io_service(new boost::asio::io_service(per_core ? 1 : static_cast<int>(thread_cnt)));
+		work_ptr work(new boost::asio::io_service::work(*io_service));
+		io_services_.push_back(io_service);
+		work_.push_back(work);
+	}
+}
+
+void io_service_pool::run()
+{
+	// Create a pool of threads, thread i runs io_service i % size().
+	vector<shared_ptr<thread> > threads;
+	for (size_t i = 0; i < thread_cnt_; ++i)
+	{
+		boost::asio::io_service& io_service = *io_services_[i % io_services_.size()];
+		shared_ptr<thread> thread(new std::thread([this, i, &io_service]()
+		{
+			if (cpu_affinity_)
+				set_cpu_affinity(i);
+
+			while (true)
+			{
+				try
+				{
+					io_service.run();
+					break;
+				}
+				catch (std::exception&e)
+				{
+					AUTH_LOG(error) << "io_service.run() exception:" << e.what();
+				}
+			}
+		}));
+		threads.push_back(thread);
+	}
+
+	// Wait for all threads in the pool to exit.
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i]->join();
+}
+
+void io_service_pool::stop()
+{
+	// Explicitly stop all io_services.
+	for (size_t i = 0; i < io_services_.size(); ++i)
+		io_services_[i]->stop();
+}
+
+size_t io_service_pool::size() const
+{
+	return io_services_.size();
+}
+
+boost::asio::io_service& io_service_pool::get_io_service(size_t index)
+{
+	return *io_services_[index % io_services_.size()];
+}
+
+void io_service_pool::set_cpu_affinity(size_t index)
+{
+	unsigned cpu_cnt = std::thread::hardware_concurrency();
+	if (cpu_cnt == 0)
+		return;
+
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(index % cpu_cnt, &cpuset);
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0)
+	{
+		AUTH_LOG(warning) << "bind thread " << index << " to cpu " << index % cpu_cnt << " failed";
+	}
+}
@@ -0,0 +1,60 @@
+//
+// io_service_pool.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2003-2017 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef IO_SERVICE_POOL_HPP
+#define IO_SERVICE_POOL_HPP
+
+#include <boost/asio.hpp>
+#include <vector>
+#include <memory>
+#include <boost/noncopyable.hpp>
+
+// A pool of io_service objects.
+// In shared mode there is one io_service run by every thread; in per-core
+// mode every thread owns its own io_service (a shard) and may be pinned to a cpu.
+class io_service_pool
+	: private boost::noncopyable
+{
+public:
+	// Construct the io_service pool.
+	io_service_pool(std::size_t thread_cnt, bool per_core, bool cpu_affinity);
+
+	// Run all io_service objects in the pool.
+	void run();
+
+	// Stop all io_service objects in the pool.
+	void stop();
+
+	// Number of io_service objects (shards) in the pool.
+	std::size_t size() const;
+
+	// Get the io_service of the given shard.
+	boost::asio::io_service& get_io_service(std::size_t index);
+
+private:
+	typedef std::shared_ptr<boost::asio::io_service> io_service_ptr;
+	typedef std::shared_ptr<boost::asio::io_service::work> work_ptr;
+
+	// Pin the calling thread to a cpu.
+	static void set_cpu_affinity(std::size_t index);
+
+	// The pool of io_services.
+	std::vector<io_service_ptr> io_services_;
+
+	// The work that keeps the io_services running.
+	std::vector<work_ptr> work_;
+
+	// The number of threads that will call io_service::run().
+	std::size_t thread_cnt_;
+
+	bool cpu_affinity_;
+};
+
+#endif // IO_SERVICE_POOL_HPP
@@ -0,0 +1,55 @@
+#include "local_storage.hpp"
+#include "auth_config.hpp"
+#include "metrics.hpp"
+#include "async_log.hpp"
+
+using namespace std;
+
+local_storage::local_storage(const string& dir)
+	: store_(dir,
+		chrono::milliseconds(boost::serialization::singleton<auth_config>::get_const_instance().journal_sync_interval_),
+		chrono::seconds(boost::serialization::singleton<auth_config>::get_const_instance().snapshot_interval_))
+{
+}
+
+void local_storage::load(group_lookup group)
+{
+	//Nothing else holds the records, an unusable snapshot throws
+	if (!store_.restore(group, false))
+		AUTH_LOG(info) << "Local store is empty";
+}
+
+void local_storage::start(const local_store::dump_handler& dump)
+{
+	store_.start(dump);
+}
+
+void local_storage::stop()
+{
+	store_.stop();
+}
+
+void local_storage::insert(unsigned gid, const auth_info& auth)
+{
+	store_.put(gid, vector<auth_info>(1, auth));
+}
+
+void local_storage::insert(unsigned gid, const vector<auth_info>& auths)
+{
+	store_.put(gid, auths);
+}
+
+void local_storage::erase(const vector<pair<unsigned, uint64_t> >& records)
+{
+	store_.erase(records);
+}
+
+void local_storage::purge(time_t now)
+{
+}
+
+void local_storage::report(ostream& out)
+{
+	metrics::write_header(out, "ik_auth_journal_pending_bytes", "gauge", "Journaled bytes not written yet");
+	out << "ik_auth_journal_pending_bytes " << store_.pending() << '\n';
+}
@@ -0,0 +1,32 @@
+#ifndef LOCAL_STORAGE_HPP
+#define LOCAL_STORAGE_HPP
+
+#include <string>
+#include "storage.hpp"
+#include "local_store.hpp"
+
+//Embedded storage on the local journal and snapshot, no database needed
+class local_storage
+	: public storage
+{
+public:
+	explicit local_storage(const std::string& dir);
+
+	void load(group_lookup group) override;
+	void start(const local_store::dump_handler& dump) override;
+	void stop() override;
+
+	void insert(unsigned gid, const auth_info& auth) override;
+	void insert(unsigned gid, const std::vector<auth_info>& auths) override;
+	void erase(const std::vector<std::pair<unsigned, uint64_t> >& records) override;
+
+	//Restore skips the expired records and snapshots only hold live ones
+	void purge(time_t now) override;
+
+	void report(std::ostream& out) override;
+
+private:
+	local_store store_;
+};
+
+#endif
@@ -0,0 +1,468 @@
+#include "local_store.hpp"
+#include "auth_group.hpp"
+#include "mac_table.hpp"
+#include "byte_order.hpp"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+#include "async_log.hpp"
+
+using namespace std;
+using namespace std::chrono;
+namespace fs = boost::filesystem;
+
+static const char snapshot_magic[8] = { 'I', 'K', 'S', 'N', 'A', 'P', '0', '1' };
+
+//The journal thread is woken early once this much is waiting
+static const size_t flush_bytes = 1 << 20;
+
+static bool write_all(int fd, const char* data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = ::write(fd, data, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+static void sync_dir(const string& dir)
+{
+	int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd >= 0)
+	{
+		::fsync(fd);
+		::close(fd);
+	}
+}
+
+//False if the group isn't ours, a group reclaimed meanwhile is looked up again
+static bool load_run(const local_store::group_lookup& group, unsigned gid, vector<auth_info>& auths)
+{
+	for (;;)
+	{
+		auth_group* g = group(gid);
+		if (!g)
+			return false;
+		if (g->load(auths))
+			return true;
+	}
+}
+
+local_store::local_store(const string& dir, milliseconds sync_interval, seconds snapshot_interval)
+	: dir_(dir), sync_interval_(sync_interval), snapshot_interval_(snapshot_interval)
+{
+	//The boost::filesystem::filesystem_error may be thrown out
+	fs::create_directories(dir_);
+}
+
+local_store::~local_store()
+{
+	stop();
+}
+
+void local_store::put_record(string& out, uint8_t type, unsigned gid, uint64_t mac, const auth_info& auth)
+{
+	size_t begin = out.size();
+	put_uint(out, type, 1);
+	put_uint(out, gid, 4);
+	put_uint(out, mac, 6);
+	put_uint(out, auth.attr_, 2);
+	put_uint(out, auth.duration_, 4);
+	put_uint(out, auth.auth_time_, 4);
+	put_uint(out, auth.res1_, 4);
+	put_uint(out, auth.res2_, 4);
+
+	boost::crc_32_type crc;
+	crc.process_bytes(out.data() + begin, out.size() - begin);
+	put_uint(out, crc.checksum(), 4);
+}
+
+bool local_store::get_record(const uint8_t* in, uint8_t& type, unsigned& gid, auth_info& auth)
+{
+	boost::crc_32_type crc;
+	crc.process_bytes(in, record_len - 4);
+	if (crc.checksum() != get_uint(in + record_len - 4, 4))
+		return false;
+
+	type = in[0];
+	gid = static_cast<unsigned>(get_uint(in + 1, 4));
+	auth.mac_ = auth_record::mac_string(get_uint(in + 5, 6));
+	auth.attr_ = static_cast<uint16_t>(get_uint(in + 11, 2));
+	auth.duration_ = static_cast<uint32_t>(get_uint(in + 13, 4));
+	auth.auth_time_ = static_cast<uint32_t>(get_uint(in + 17, 4));
+	auth.res1_ = static_cast<uint32_t>(get_uint(in + 21, 4));
+	auth.res2_ = static_cast<uint32_t>(get_uint(in + 25, 4));
+	return type == RECORD_PUT || type == RECORD_ERASE;
+}
+
+string local_store::segment_path(uint64_t segment) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "journal.%016llx", static_cast<unsigned long long>(segment));
+	return (fs::path(dir_) / name).string();
+}
+
+string local_store::snapshot_path() const
+{
+	return (fs::path(dir_) / "snapshot").string();
+}
+
+vector<uint64_t> local_store::segments() const
+{
+	vector<uint64_t> found;
+	for (fs::directory_iterator it(dir_), end; it != end; ++it)
+	{
+		string name = it->path().filename().string();
+		if (name.size() == 24 && name.compare(0, 8, "journal.") == 0)
+			found.push_back(strtoull(name.c_str() + 8, nullptr, 16));
+	}
+	sort(found.begin(), found.end());
+	return found;
+}
+
+bool local_store::restore(const group_lookup& group, bool fallback)
+{
+	auto start = steady_clock::now();
+	size_t count = 0;
+
+	bool has_snapshot = fs::exists(snapshot_path());
+	uint64_t snapshot = has_snapshot ? restore_snapshot(group, count) : 0;
+	bool corrupt = has_snapshot && snapshot == 0;
+	if (corrupt)
+	{
+		//The segments before the snapshot's are gone, only the snapshot had their records
+		if (!fallback)
+			throw runtime_error("snapshot " + snapshot_path() + " is unusable, the local store can't be restored");
+		fs::rename(snapshot_path(), snapshot_path() + ".corrupt");
+		AUTH_LOG(error) << "snapshot moved to " << snapshot_path() << ".corrupt, replay every journal segment";
+	}
+
+	vector<uint64_t> journal = segments();
+	for (auto segment : journal)
+	{
+		if (segment >= snapshot)
+			replay_segment(segment, group, count);
+	}
+
+	//The next segment comes after every existing one, none is appended to again
+	segment_ = max(snapshot, journal.empty() ? 0 : journal.back());
+
+	auto elapsed = duration_cast<milliseconds>(steady_clock::now() - start);
+	AUTH_LOG(info) << "Restore " << count << " record from local store in " << elapsed.count() << "ms";
+	return !corrupt && (has_snapshot || !journal.empty());
+}
+
+uint64_t local_store::restore_snapshot(const group_lookup& group, size_t& count)
+{
+	int fd = ::open(snapshot_path().c_str(), O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < snapshot_header_len)
+	{
+		::close(fd);
+		AUTH_LOG(error) << "snapshot " << snapshot_path() << " is truncated";
+		return 0;
+	}
+
+	size_t len = st.st_size;
+	void* map = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+	{
+		AUTH_LOG(error) << "mmap snapshot error " << strerror(errno);
+		return 0;
+	}
+	::madvise(map, len, MADV_SEQUENTIAL);
+
+	const uint8_t* data = static_cast<const uint8_t*>(map);
+	uint64_t segment = get_uint(data + 8, 8);
+	uint64_t records = get_uint(data + 16, 8);
+	if (memcmp(data, snapshot_magic, sizeof(snapshot_magic)) != 0 || segment == 0
+		|| len != snapshot_header_len + records * record_len)
+	{
+		::munmap(map, len);
+		AUTH_LOG(error) << "snapshot " << snapshot_path() << " is corrupt";
+		return 0;
+	}
+
+	//The snapshot is written group by group, hand every group its run at once
+	time_t now = time(NULL);
+	vector<auth_info> auths;
+	unsigned run_gid = 0;
+	for (const uint8_t* p = data + snapshot_header_len; p < data + len; p += record_len)
+	{
+		uint8_t type;
+		unsigned gid;
+		auth_info auth;
+		if (!get_record(p, type, gid, auth))
+		{
+			::munmap(map, len);
+			AUTH_LOG(error) << "snapshot " << snapshot_path() << " is corrupt";
+			return 0;
+		}
+		if (gid != run_gid && !auths.empty())
+		{
+			load_run(group, run_gid, auths);
+			auths.clear();
+		}
+		run_gid = gid;
+		if (auth.auth_time_ + auth.duration_ > now)
+		{
+			auths.push_back(auth);
+			count++;
+		}
+	}
+	if (!auths.empty())
+		load_run(group, run_gid, auths);
+
+	::munmap(map, len);
+	return segment;
+}
+
+void local_store::replay_segment(uint64_t segment, const group_lookup& group, size_t& count)
+{
+	string path = segment_path(segment);
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+
+	string data;
+	char chunk[65536];
+	ssize_t n;
+	while ((n = ::read(fd, chunk, sizeof(chunk))) > 0)
+		data.append(chunk, n);
+	::close(fd);
+
+	time_t now = time(NULL);
+	const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+	for (size_t off = 0; off + record_len <= data.size(); off += record_len)
+	{
+		uint8_t type;
+		unsigned gid;
+		vector<auth_info> auths(1);
+		if (!get_record(p + off, type, gid, auths[0]))
+		{
+			//A write torn by a crash ends the segment
+			AUTH_LOG(warning) << "journal " << path << " ends with a torn record at " << off;
+			return;
+		}
+
+		if (type == RECORD_ERASE)
+		{
+			auth_group* g = group(gid);
+			if (!g)
+				continue;
+			g->erase(auths[0]);
+		}
+		else if (auths[0].auth_time_ + auths[0].duration_ > now)
+		{
+			if (!load_run(group, gid, auths))
+				continue;
+		}
+		count++;
+	}
+}
+
+void local_store::start(dump_handler dump)
+{
+	dump_ = dump;
+	rotate();
+
+	journal_thread_ = thread(&local_store::run_journal, this);
+	snapshot_thread_ = thread(&local_store::run_snapshot, this);
+}
+
+void local_store::stop()
+{
+	{
+		lock_guard<mutex> lock(mutex_);
+		stopped_ = true;
+	}
+	cond_.notify_all();
+
+	if (journal_thread_.joinable())
+		journal_thread_.join();
+	if (snapshot_thread_.joinable())
+		snapshot_thread_.join();
+
+	lock_guard<mutex> io_lock(io_mutex_);
+	if (fd_ >= 0)
+	{
+		sync();
+		::close(fd_);
+		fd_ = -1;
+	}
+}
+
+size_t local_store::pending()
+{
+	lock_guard<mutex> lock(mutex_);
+	return buffer_.size();
+}
+
+void local_store::put(unsigned gid, const vector<auth_info>& auths)
+{
+	string records;
+	for (auto& auth : auths)
+		put_record(records, RECORD_PUT, gid, auth_message::mac_key(auth.mac_) & mac_mask, auth);
+
+	lock_guard<mutex> lock(mutex_);
+	buffer_ += records;
+	if (buffer_.size() >= flush_bytes)
+		cond_.notify_all();
+}
+
+void local_store::erase(const vector<pair<unsigned, uint64_t> >& records)
+{
+	string out;
+	auth_info none = auth_info();
+	for (auto& record : records)
+		put_record(out, RECORD_ERASE, record.first, record.second, none);
+
+	lock_guard<mutex> lock(mutex_);
+	buffer_ += out;
+	if (buffer_.size() >= flush_bytes)
+		cond_.notify_all();
+}
+
+void local_store::sync()
+{
+	string out;
+	{
+		lock_guard<mutex> lock(mutex_);
+		out.swap(buffer_);
+	}
+	if (out.empty() || fd_ < 0)
+		return;
+
+	if (!write_all(fd_, out.data(), out.size()) || ::fdatasync(fd_) != 0)
+		AUTH_LOG(error) << "write journal " << segment_path(segment_) << " error " << strerror(errno);
+}
+
+uint64_t local_store::rotate()
+{
+	lock_guard<mutex> io_lock(io_mutex_);
+
+	if (fd_ >= 0)
+	{
+		sync();
+		::close(fd_);
+	}
+
+	segment_++;
+	fd_ = ::open(segment_path(segment_).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd_ < 0)
+		AUTH_LOG(error) << "open journal " << segment_path(segment_) << " error " << strerror(errno);
+	sync_dir(dir_);
+	return segment_;
+}
+
+void local_store::run_journal()
+{
+	unique_lock<mutex> lock(mutex_);
+	for (;;)
+	{
+		//Group commit: everything journaled in one interval shares one fdatasync
+		cond_.wait_for(lock, sync_interval_, [this]() { return stopped_ || buffer_.size() >= flush_bytes; });
+		bool stopped = stopped_;
+		lock.unlock();
+		{
+			lock_guard<mutex> io_lock(io_mutex_);
+			sync();
+		}
+		lock.lock();
+		if (stopped)
+			break;
+	}
+}
+
+void local_store::run_snapshot()
+{
+	//Without a snapshot a restart would need the whole journal since the first start
+	if (!fs::exists(snapshot_path()))
+		write_snapshot();
+
+	unique_lock<mutex> lock(mutex_);
+	while (!cond_.wait_for(lock, snapshot_interval_, [this]() { return stopped_; }))
+	{
+		lock.unlock();
+		write_snapshot();
+		lock.lock();
+	}
+}
+
+void local_store::write_snapshot()
+{
+	auto start = steady_clock::now();
+
+	//Changes from now on go to the new segment, the snapshot covers the older ones
+	uint64_t segment = rotate();
+
+	string tmp = snapshot_path() + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		AUTH_LOG(error) << "open snapshot " << tmp << " error " << strerror(errno);
+		return;
+	}
+
+	string out(snapshot_header_len, '\0');
+	uint64_t count = 0;
+	bool ok = true;
+	dump_([&](unsigned gid, const vector<auth_info>& auths)
+	{
+		for (auto& auth : auths)
+			put_record(out, RECORD_PUT, gid, auth_message::mac_key(auth.mac_) & mac_mask, auth);
+		count += auths.size();
+		if (out.size() >= flush_bytes)
+		{
+			ok = ok && write_all(fd, out.data(), out.size());
+			out.clear();
+		}
+	});
+	ok = ok && write_all(fd, out.data(), out.size());
+
+	string header(snapshot_magic, sizeof(snapshot_magic));
+	put_uint(header, segment, 8);
+	put_uint(header, count, 8);
+	header.resize(snapshot_header_len, '\0');
+	ok = ok && ::pwrite(fd, header.data(), header.size(), 0) == static_cast<ssize_t>(header.size());
+	ok = ok && ::fdatasync(fd) == 0;
+	::close(fd);
+
+	if (!ok || ::rename(tmp.c_str(), snapshot_path().c_str()) != 0)
+	{
+		AUTH_LOG(error) << "write snapshot " << tmp << " error " << strerror(errno);
+		::unlink(tmp.c_str());
+		return;
+	}
+	sync_dir(dir_);
+
+	//The segments before the snapshot's are covered by it
+	for (auto old : segments())
+	{
+		if (old < segment)
+			::unlink(segment_path(old).c_str());
+	}
+
+	auto elapsed = duration_cast<milliseconds>(steady_clock::now() - start);
+	AUTH_LOG(info) << "Snapshot " << count << " record in " << elapsed.count() << "ms";
+}
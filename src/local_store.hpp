@@ -0,0 +1,105 @@
+#ifndef LOCAL_STORE_HPP
+#define LOCAL_STORE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <boost/noncopyable.hpp>
+#include "auth_message.hpp"
+
+class auth_group;
+
+//Local persistence of the groups for a fast restart: an append-only journal of
+//the group changes, group committed every sync interval with one fdatasync, and
+//a periodic binary snapshot that is memory mapped at startup.
+//Before a snapshot is written the journal moves to a new segment; the snapshot
+//names that segment, so a restore loads the snapshot and replays that segment
+//and the later ones. Changes made while the snapshot is written are in both,
+//replaying them again is harmless.
+class local_store
+	: private boost::noncopyable
+{
+public:
+	typedef std::function<void(unsigned gid, const std::vector<auth_info>& auths)> record_sink;
+	typedef std::function<void(const record_sink& sink)> dump_handler;
+	//The group of a gid, null for a gid this server doesn't keep
+	typedef std::function<auth_group*(unsigned gid)> group_lookup;
+
+	local_store(const std::string& dir, std::chrono::milliseconds sync_interval, std::chrono::seconds snapshot_interval);
+	~local_store();
+
+	//Load the snapshot and replay the journal into the groups, false if there was neither.
+	//A truncated or corrupt snapshot throws when the store is all there is; with a database
+	//to fall back on it is kept aside as snapshot.corrupt, every segment is replayed and
+	//false is returned, so the caller loads the database as well
+	bool restore(const group_lookup& group, bool fallback);
+
+	//Open a new journal segment and start the journal and snapshot threads,
+	//dump hands every live group to the snapshot
+	void start(dump_handler dump);
+
+	//Write what is journaled and stop the threads
+	void stop();
+
+	//Journal changes, called from any thread, never waits on the disk
+	void put(unsigned gid, const std::vector<auth_info>& auths);
+	void erase(const std::vector<std::pair<unsigned, uint64_t> >& records);
+
+	//Bytes journaled and not written yet
+	std::size_t pending();
+
+private:
+	enum Record_Type
+	{
+		RECORD_PUT = 1,
+		RECORD_ERASE = 2
+	};
+
+	//type[1] gid[4] mac[6] attr[2] duration[4] auth_time[4] res1[4] res2[4] crc32[4]
+	static const std::size_t record_len = 33;
+	static const std::size_t snapshot_header_len = 32;
+
+	static void put_record(std::string& out, uint8_t type, unsigned gid, uint64_t mac, const auth_info& auth);
+	static bool get_record(const uint8_t* in, uint8_t& type, unsigned& gid, auth_info& auth);
+
+	std::string segment_path(uint64_t segment) const;
+	std::string snapshot_path() const;
+	std::vector<uint64_t> segments() const;
+
+	//Snapshot segment, 0 if there is no usable snapshot
+	uint64_t restore_snapshot(const group_lookup& group, std::size_t& count);
+	void replay_segment(uint64_t segment, const group_lookup& group, std::size_t& count);
+
+	//Write the buffer out and sync it, io_mutex_ locked
+	void sync();
+	//Sync and continue in a new segment, returns its number
+	uint64_t rotate();
+
+	void run_journal();
+	void run_snapshot();
+	void write_snapshot();
+
+	std::string dir_;
+	std::chrono::milliseconds sync_interval_;
+	std::chrono::seconds snapshot_interval_;
+	dump_handler dump_;
+
+	std::string buffer_;//journaled, not written yet
+	std::mutex mutex_;//buffer_ and stopped_
+	std::condition_variable cond_;
+	bool stopped_ = false;
+
+	int fd_ = -1;
+	uint64_t segment_ = 0;
+	std::mutex io_mutex_;//fd_ and segment_
+
+	std::thread journal_thread_;
+	std::thread snapshot_thread_;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include "mac_table.hpp"
+
+using namespace std;
+
+void auth_record::from_auth_info(const auth_info& auth)
+{
+	mac_attr_ = (auth_message::mac_key(auth.mac_) & mac_mask) | (static_cast<uint64_t>(auth.attr_) << 48);
+	seq_ = auth.seq_;
+	duration_ = auth.duration_;
+	auth_time_ = auth.auth_time_;
+	res1_ = auth.res1_;
+	res2_ = auth.res2_;
+}
+
+string auth_record::mac_string(uint64_t mac)
+{
+	uint8_t bytes[6];
+	for (int i = 0; i < 6; i++)
+		bytes[i] = static_cast<uint8_t>(mac >> (40 - 8 * i));
+	return auth_message::bytes_to_mac(bytes);
+}
+
+auth_info auth_record::to_auth_info() const
+{
+	auth_info auth;
+	auth.mac_ = mac_string(mac());
+	auth.attr_ = attr();
+	auth.duration_ = duration_;
+	auth.auth_time_ = auth_time_;
+	auth.res1_ = res1_;
+	auth.res2_ = res2_;
+	auth.seq_ = seq_;
+	return auth;
+}
+
+mac_table::mac_table()
+	: slots_(16, auth_record()),
+	size_(0)
+{
+}
+
+const auth_record* mac_table::find(uint64_t mac) const
+{
+	size_t slot = slot_of(mac);
+	return slots_[slot].seq_ != 0 ? &slots_[slot] : nullptr;
+}
+
+void mac_table::insert(const auth_record& record)
+{
+	//Keep the load factor under 0.75
+	if ((size_ + 1) * 4 > slots_.size() * 3)
+		grow();
+
+	size_t slot = slot_of(record.mac());
+	if (slots_[slot].seq_ == 0)
+		size_++;
+	slots_[slot] = record;
+}
+
+bool mac_table::erase(uint64_t mac)
+{
+	size_t slot = slot_of(mac);
+	if (slots_[slot].seq_ == 0)
+		return false;
+
+	erase_slot(slot);
+	return true;
+}
+
+//Finalizer of MurmurHash3, spreads the vendor prefix of the mac over all bits
+uint64_t mac_table::hash(uint64_t mac)
+{
+	mac ^= mac >> 33;
+	mac *= 0xff51afd7ed558ccdull;
+	mac ^= mac >> 33;
+	mac *= 0xc4ceb9fe1a85ec53ull;
+	mac ^= mac >> 33;
+	return mac;
+}
+
+//The slot holding the mac, or the empty slot where it belongs
+size_t mac_table::slot_of(uint64_t mac) const
+{
+	size_t mask = slots_.size() - 1;
+	size_t slot = hash(mac) & mask;
+	while (slots_[slot].seq_ != 0 && slots_[slot].mac() != mac)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+void mac_table::erase_slot(size_t slot)
+{
+	size_t mask = slots_.size() - 1;
+	size_t hole = slot;
+
+	//Move back every following record whose home slot is not between the hole and itself
+	for (size_t next = (hole + 1) & mask; slots_[next].seq_ != 0; next = (next + 1) & mask)
+	{
+		size_t home = hash(slots_[next].mac()) & mask;
+		if (((next - home) & mask) >= ((next - hole) & mask))
+		{
+			slots_[hole] = slots_[next];
+			hole = next;
+		}
+	}
+
+	slots_[hole] = auth_record();
+	size_--;
+}
+
+void mac_table::grow()
+{
+	vector<auth_record> old(slots_.size() * 2, auth_record());
+	old.swap(slots_);
+	size_ = 0;
+
+	for (auto& record : old)
+	{
+		if (record.seq_ != 0)
+		{
+			slots_[slot_of(record.mac())] = record;
+			size_++;
+		}
+	}
+}
@@ -0,0 +1,84 @@
+#ifndef MAC_TABLE_HPP
+#define MAC_TABLE_HPP
+
+#include <cstdint>
+#include <ctime>
+#include <vector>
+#include "auth_message.hpp"
+
+//Low 48 bits of a mac_key() are the mac
+const uint64_t mac_mask = 0xFFFFFFFFFFFFull;
+
+//An auth_info packed into 32 bytes, the mac is kept as an integer
+struct auth_record
+{
+	uint64_t mac_attr_;	//mac in the low 48 bits, attr in the high 16 bits
+	uint64_t seq_;		//group sequence of the last change, 0 marks an empty slot
+	uint32_t duration_;
+	uint32_t auth_time_;
+	uint32_t res1_;		// reserve
+	uint32_t res2_;		// reserve
+
+	uint64_t mac() const { return mac_attr_ & mac_mask; }
+	uint16_t attr() const { return static_cast<uint16_t>(mac_attr_ >> 48); }
+	bool expired(time_t now) const { return now - auth_time_ >= duration_; }
+
+	void from_auth_info(const auth_info& auth);
+	static std::string mac_string(uint64_t mac);//"AA:BB:CC:DD:EE:FF"
+	auth_info to_auth_info() const;
+};
+
+//Open addressing hash table of auth records keyed by mac.
+//Linear probing, deletes shift the following records back so there are no tombstones.
+class mac_table
+{
+public:
+	mac_table();
+
+	//The record of the mac, nullptr if there is none
+	const auth_record* find(uint64_t mac) const;
+
+	//Insert or overwrite, record.seq_ must not be 0
+	void insert(const auth_record& record);
+
+	bool erase(uint64_t mac);
+
+	std::size_t size() const { return size_; }
+
+	//Call f(record) for every record
+	template <typename Func>
+	void for_each(Func f) const
+	{
+		for (auto& slot : slots_)
+		{
+			if (slot.seq_ != 0)
+				f(slot);
+		}
+	}
+
+	//Erase every record pred(record) is true for
+	template <typename Pred>
+	void erase_if(Pred pred)
+	{
+		for (std::size_t i = 0; i < slots_.size();)
+		{
+			//Erasing shifts the next record into slot i, so check it again
+			if (slots_[i].seq_ != 0 && pred(slots_[i]))
+				erase_slot(i);
+			else
+				++i;
+		}
+	}
+
+private:
+	static uint64_t hash(uint64_t mac);
+
+	std::size_t slot_of(uint64_t mac) const;
+	void erase_slot(std::size_t slot);
+	void grow();
+
+	std::vector<auth_record> slots_;//size is a power of 2
+	std::size_t size_;
+};
+
+#endif
@@ -2,10 +2,10 @@
 #include <iostream>
 #include <string>
 #include <boost/program_options.hpp>
-#include <boost/log/trivial.hpp>
 
+#include "async_log.hpp"
 #include "auth_config.hpp"
-#include "sync_db.hpp"
+#include "storage.hpp"
 #include "server.hpp"
 using namespace std;
 namespace po = boost::program_options;
@@ -21,16 +21,17 @@ int main(int argc, const char **argv)
 
 	try
 	{
-		sync_db database(config.db_server_, config.db_user_, config.db_pwd_, config.thread_cnt_);
-		server auth_server(config.port_, config.thread_cnt_, database);
+		unique_ptr<storage> database = storage::create(config);
+		server auth_server(config.port_, config.thread_cnt_, config.io_per_core_, config.cpu_affinity_, *database);
 		auth_server.run();
 	}
 	catch (const exception &e) 
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "program exit exception:" << e.what();
+		AUTH_LOG(fatal) << "program exit exception:" << e.what();
 	}
 
-	BOOST_LOG_TRIVIAL(info) << "server shutdowm!!";
+	AUTH_LOG(info) << "server shutdowm!!";
+	async_log::stop();
 	return 0; 
 }
 
@@ -82,9 +83,11 @@ static void process_command(int argc, const char **argv)
 
 	if (daemon(1, 0))
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "daemon failed" ;
+		AUTH_LOG(fatal) << "daemon failed" ;
 		exit(1);
 	}
 
-	BOOST_LOG_TRIVIAL(info) << "process command success!!";
+	//The writer thread is started after the fork, the child wouldn't have it
+	async_log::start(config.log_queue_size_, static_cast<async_log::severity_level>(config.log_level_));
+	AUTH_LOG(info) << "process command success!!";
 }
\ No newline at end of file
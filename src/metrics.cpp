@@ -0,0 +1,204 @@
+#include "metrics.hpp"
+
+using namespace std;
+
+static const char* const counter_names[METRIC_COUNTER_NR][3] =
+{
+	{ "ik_auth_connections", "gauge", "handshake" },
+	{ "ik_auth_connections", "gauge", "certified" },
+	{ "ik_auth_chap_failures_total", "counter", "Clients that failed the CHAP handshake" },
+	{ "ik_auth_redirects_total", "counter", "Clients redirected to the node owning their gid" },
+	{ "ik_auth_connections_reaped_total", "counter", "Clients closed for missing the handshake or idle deadline" },
+	{ "ik_auth_recv_reads_total", "counter", "Socket reads of the client connections, each parses every frame it completes" },
+	{ "ik_auth_invalid_macs_total", "counter", "Received, loaded or replicated records skipped for an unparsable mac" },
+};
+
+static const char* const histogram_names[METRIC_HISTOGRAM_NR][2] =
+{
+	{ "ik_auth_fanout_size", "Participants a group change is delivered to" },
+	{ "ik_auth_lock_wait_microseconds", "Wait for a contended group lock" },
+	{ "ik_auth_db_query_microseconds", "Database statement latency" },
+};
+
+static const char* const msg_type_names[MSG_TYPE_NR] =
+{
+	"invalid", "check_client", "check_client_response", "auth_request", "auth_response", "auth_batch",
+	"redirect", "peer_hello", "peer_update", "peer_digest", "peer_chunks", "heartbeat",
+};
+
+size_t metric_buckets::index(uint64_t v)
+{
+	const uint64_t sub = 1 << sub_bits;
+	if (v < sub)
+		return static_cast<size_t>(v);
+
+	size_t msb = 63 - __builtin_clzll(v);
+	size_t i = (msb - sub_bits + 1) * sub + ((v >> (msb - sub_bits)) & (sub - 1));
+	return min(i, count - 1);
+}
+
+uint64_t metric_buckets::upper(size_t index)
+{
+	const uint64_t sub = 1 << sub_bits;
+	if (index < sub)
+		return index;
+
+	size_t msb = index / sub + sub_bits - 1;
+	uint64_t low = (sub + index % sub) << (msb - sub_bits);
+	return low + (uint64_t(1) << (msb - sub_bits)) - 1;
+}
+
+metrics::slot::slot()
+{
+	for (auto& v : counters_)
+		v.store(0, memory_order_relaxed);
+	for (auto& h : buckets_)
+	{
+		for (auto& v : h)
+			v.store(0, memory_order_relaxed);
+	}
+	for (auto& v : sums_)
+		v.store(0, memory_order_relaxed);
+	for (size_t t = 0; t < MSG_TYPE_NR; t++)
+	{
+		frames_in_[t].store(0, memory_order_relaxed);
+		bytes_in_[t].store(0, memory_order_relaxed);
+		frames_out_[t].store(0, memory_order_relaxed);
+		bytes_out_[t].store(0, memory_order_relaxed);
+	}
+}
+
+vector<metrics::slot*>& metrics::slots()
+{
+	static vector<slot*> all;
+	return all;
+}
+
+mutex& metrics::slots_mutex()
+{
+	static mutex m;
+	return m;
+}
+
+metrics::slot_holder::slot_holder()
+	: slot_(nullptr)
+{
+	lock_guard<mutex> lock(slots_mutex());
+	for (auto s : slots())
+	{
+		if (s->free_)
+		{
+			s->free_ = false;
+			slot_ = s;
+			return;
+		}
+	}
+	slot_ = new slot;
+	slots().push_back(slot_);
+}
+
+metrics::slot_holder::~slot_holder()
+{
+	lock_guard<mutex> lock(slots_mutex());
+	slot_->free_ = true;
+}
+
+metrics::slot& metrics::local()
+{
+	static thread_local slot_holder holder;
+	return *holder.slot_;
+}
+
+void metrics::write_header(ostream& out, const char* name, const char* type, const char* help)
+{
+	out << "# HELP " << name << ' ' << help << '\n';
+	out << "# TYPE " << name << ' ' << type << '\n';
+}
+
+void metrics::write_histogram(ostream& out, const string& name, const string& labels,
+	const uint64_t* buckets, uint64_t sum)
+{
+	size_t last = 0;
+	uint64_t total = 0;
+	for (size_t i = 0; i < metric_buckets::count; i++)
+	{
+		if (buckets[i])
+			last = i;
+		total += buckets[i];
+	}
+
+	//Cumulative up to the highest bucket in use, the last one is +Inf
+	string sep = labels.empty() ? "" : ",";
+	uint64_t cumulative = 0;
+	for (size_t i = 0; total && i <= last && i < metric_buckets::count - 1; i++)
+	{
+		cumulative += buckets[i];
+		out << name << "_bucket{" << labels << sep << "le=\"" << metric_buckets::upper(i) << "\"} " << cumulative << '\n';
+	}
+	out << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << total << '\n';
+	out << name << "_sum" << (labels.empty() ? "" : "{" + labels + "}") << ' ' << sum << '\n';
+	out << name << "_count" << (labels.empty() ? "" : "{" + labels + "}") << ' ' << total << '\n';
+}
+
+void metrics::write(ostream& out)
+{
+	int64_t counters[METRIC_COUNTER_NR] = {};
+	vector<uint64_t> buckets(METRIC_HISTOGRAM_NR * metric_buckets::count);
+	uint64_t sums[METRIC_HISTOGRAM_NR] = {};
+	uint64_t frames_in[MSG_TYPE_NR] = {}, bytes_in[MSG_TYPE_NR] = {};
+	uint64_t frames_out[MSG_TYPE_NR] = {}, bytes_out[MSG_TYPE_NR] = {};
+
+	{
+		lock_guard<mutex> lock(slots_mutex());
+		for (auto s : slots())
+		{
+			for (size_t i = 0; i < METRIC_COUNTER_NR; i++)
+				counters[i] += s->counters_[i].load(memory_order_relaxed);
+			for (size_t h = 0; h < METRIC_HISTOGRAM_NR; h++)
+			{
+				for (size_t i = 0; i < metric_buckets::count; i++)
+					buckets[h * metric_buckets::count + i] += s->buckets_[h][i].load(memory_order_relaxed);
+				sums[h] += s->sums_[h].load(memory_order_relaxed);
+			}
+			for (size_t t = 0; t < MSG_TYPE_NR; t++)
+			{
+				frames_in[t] += s->frames_in_[t].load(memory_order_relaxed);
+				bytes_in[t] += s->bytes_in_[t].load(memory_order_relaxed);
+				frames_out[t] += s->frames_out_[t].load(memory_order_relaxed);
+				bytes_out[t] += s->bytes_out_[t].load(memory_order_relaxed);
+			}
+		}
+	}
+
+	write_header(out, "ik_auth_connections", "gauge", "Client connections by state");
+	for (size_t i = CONNECTIONS_HANDSHAKE; i <= CONNECTIONS_CERTIFIED; i++)
+		out << counter_names[i][0] << "{state=\"" << counter_names[i][2] << "\"} " << counters[i] << '\n';
+	for (size_t i = CONNECTIONS_CERTIFIED + 1; i < METRIC_COUNTER_NR; i++)
+	{
+		write_header(out, counter_names[i][0], counter_names[i][1], counter_names[i][2]);
+		out << counter_names[i][0] << ' ' << counters[i] << '\n';
+	}
+
+	struct { const char* name; const char* help; const uint64_t* values; } frames[] =
+	{
+		{ "ik_auth_frames_in_total", "Msgs received by type", frames_in },
+		{ "ik_auth_bytes_in_total", "Bytes received by msg type", bytes_in },
+		{ "ik_auth_frames_out_total", "Msgs sent by type", frames_out },
+		{ "ik_auth_bytes_out_total", "Bytes sent by msg type", bytes_out },
+	};
+	for (auto& f : frames)
+	{
+		write_header(out, f.name, "counter", f.help);
+		for (size_t t = 1; t < MSG_TYPE_NR; t++)
+		{
+			if (f.values[t])
+				out << f.name << "{type=\"" << msg_type_names[t] << "\"} " << f.values[t] << '\n';
+		}
+	}
+
+	for (size_t h = 0; h < METRIC_HISTOGRAM_NR; h++)
+	{
+		write_header(out, histogram_names[h][0], "histogram", histogram_names[h][1]);
+		write_histogram(out, histogram_names[h][0], "", &buckets[h * metric_buckets::count], sums[h]);
+	}
+}
@@ -0,0 +1,198 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "auth_message.hpp"
+
+//Counters and gauges of the hot path
+enum Metric_Counter
+{
+	CONNECTIONS_HANDSHAKE,	//gauge: accepted, not certified yet
+	CONNECTIONS_CERTIFIED,	//gauge: joined a group
+	CHAP_FAILURES,
+	REDIRECTS,
+	CONNECTIONS_REAPED,		//closed by the handshake or idle deadline
+	RECV_READS,				//socket reads of the client connections
+	INVALID_MACS,			//received, loaded or replicated records skipped for an unparsable mac
+	METRIC_COUNTER_NR
+};
+
+//Latency and size distributions of the hot path
+enum Metric_Histogram
+{
+	FANOUT_SIZE,		//participants a change is delivered to
+	LOCK_WAIT_US,		//time spent waiting for a contended group lock
+	DB_QUERY_US,		//database statement latency
+	METRIC_HISTOGRAM_NR
+};
+
+//Log-linear buckets like HdrHistogram: 4 sub-buckets per power of two, so a
+//bucket is at most 25% wide. Values past the last bucket land in it
+struct metric_buckets
+{
+	static const std::size_t sub_bits = 2;
+	static const std::size_t count = 38 * (1 << sub_bits);
+
+	static std::size_t index(uint64_t v);
+	//Largest value of the bucket
+	static uint64_t upper(std::size_t index);
+};
+
+//Hot path metrics. Every thread writes only its own slot, so an update is a plain
+//relaxed load and store on a line no other thread writes; a scrape sums the slots.
+//A slot outlives its thread and is handed to the next new thread, so the sums
+//never go back.
+class metrics
+{
+public:
+	static void add(Metric_Counter counter, int64_t n = 1)
+	{
+		bump(local().counters_[counter], n);
+	}
+
+	static void observe(Metric_Histogram histogram, uint64_t v)
+	{
+		slot& s = local();
+		bump(s.buckets_[histogram][metric_buckets::index(v)], 1);
+		bump(s.sums_[histogram], v);
+	}
+
+	static void frame_in(uint8_t type, std::size_t bytes)
+	{
+		slot& s = local();
+		bump(s.frames_in_[type < MSG_TYPE_NR ? type : 0], 1);
+		bump(s.bytes_in_[type < MSG_TYPE_NR ? type : 0], bytes);
+	}
+
+	static void frame_out(uint8_t type, std::size_t bytes)
+	{
+		slot& s = local();
+		bump(s.frames_out_[type < MSG_TYPE_NR ? type : 0], 1);
+		bump(s.bytes_out_[type < MSG_TYPE_NR ? type : 0], bytes);
+	}
+
+	//Prometheus text of the hot path metrics
+	static void write(std::ostream& out);
+
+	//Prometheus text helpers for the metrics kept elsewhere
+	static void write_header(std::ostream& out, const char* name, const char* type, const char* help);
+	static void write_histogram(std::ostream& out, const std::string& name, const std::string& labels,
+		const uint64_t* buckets, uint64_t sum);
+
+private:
+	//Heap allocated, the padding keeps the next slot off the last cache line
+	struct slot
+	{
+		std::atomic<int64_t> counters_[METRIC_COUNTER_NR];
+		std::atomic<uint64_t> buckets_[METRIC_HISTOGRAM_NR][metric_buckets::count];
+		std::atomic<uint64_t> sums_[METRIC_HISTOGRAM_NR];
+		std::atomic<uint64_t> frames_in_[MSG_TYPE_NR];
+		std::atomic<uint64_t> bytes_in_[MSG_TYPE_NR];
+		std::atomic<uint64_t> frames_out_[MSG_TYPE_NR];
+		std::atomic<uint64_t> bytes_out_[MSG_TYPE_NR];
+		bool free_ = false;
+		char pad_[64];
+
+		slot();
+	};
+
+	//Only the owning thread writes a slot, no read-modify-write needed
+	static void bump(std::atomic<uint64_t>& v, uint64_t n)
+	{
+		v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	static void bump(std::atomic<int64_t>& v, int64_t n)
+	{
+		v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	static slot& local();
+
+	//Returns the slot to the free list when its thread exits
+	struct slot_holder
+	{
+		slot* slot_;
+		slot_holder();
+		~slot_holder();
+	};
+
+	static std::vector<slot*>& slots();
+	static std::mutex& slots_mutex();
+};
+
+//Lock a mutex, the wait for a contended one goes to LOCK_WAIT_US
+inline void timed_lock(std::mutex& mutex)
+{
+	if (!mutex.try_lock())
+	{
+		auto start = std::chrono::steady_clock::now();
+		mutex.lock();
+		metrics::observe(LOCK_WAIT_US, std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count());
+	}
+}
+
+class timed_lock_guard
+{
+public:
+	explicit timed_lock_guard(std::mutex& mutex)
+		: mutex_(mutex)
+	{
+		timed_lock(mutex_);
+	}
+
+	~timed_lock_guard()
+	{
+		mutex_.unlock();
+	}
+
+	timed_lock_guard(const timed_lock_guard&) = delete;
+	timed_lock_guard& operator=(const timed_lock_guard&) = delete;
+
+private:
+	std::mutex& mutex_;
+};
+
+//timed_lock_guard that can be unlocked and locked again
+class timed_unique_lock
+{
+public:
+	explicit timed_unique_lock(std::mutex& mutex)
+		: mutex_(mutex)
+	{
+		lock();
+	}
+
+	~timed_unique_lock()
+	{
+		if (owns_)
+			mutex_.unlock();
+	}
+
+	void lock()
+	{
+		timed_lock(mutex_);
+		owns_ = true;
+	}
+
+	void unlock()
+	{
+		mutex_.unlock();
+		owns_ = false;
+	}
+
+	timed_unique_lock(const timed_unique_lock&) = delete;
+	timed_unique_lock& operator=(const timed_unique_lock&) = delete;
+
+private:
+	std::mutex& mutex_;
+	bool owns_ = false;
+};
+
+#endif
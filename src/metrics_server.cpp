@@ -0,0 +1,108 @@
+#include "metrics_server.hpp"
+#include <sstream>
+#include "async_log.hpp"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+const chrono::seconds metrics_server::request_timeout(5);
+const chrono::milliseconds metrics_server::accept_retry(500);
+
+metrics_server::metrics_server(boost::asio::io_service& io_service, unsigned short port)
+	: io_service_(io_service),
+	acceptor_(io_service),
+	retry_timer_(io_service)
+{
+	tcp::endpoint endpoint(tcp::v4(), port);
+	acceptor_.open(endpoint.protocol());
+	acceptor_.set_option(tcp::acceptor::reuse_address(true));
+	acceptor_.bind(endpoint);
+	acceptor_.listen();
+	start_accept();
+}
+
+void metrics_server::handle(const string& path, collector collect)
+{
+	handlers_[path] = collect;
+}
+
+void metrics_server::start_accept()
+{
+	socket_ = make_shared<tcp::socket>(io_service_);
+	acceptor_.async_accept(*socket_, [this](const boost::system::error_code& e)
+	{
+		if (!e)
+		{
+			boost::asio::spawn(io_service_, bind(&metrics_server::serve, this, socket_, placeholders::_1));
+			start_accept();
+			return;
+		}
+		if (e == boost::asio::error::operation_aborted)
+			return;
+
+		//Accepting again right away would spin the io_service the clients share
+		AUTH_LOG(warning) << "metrics accept failed because of " << e.message();
+		retry_timer_.expires_from_now(accept_retry);
+		retry_timer_.async_wait([this](const boost::system::error_code& e)
+		{
+			if (!e)
+				start_accept();
+		});
+	});
+}
+
+void metrics_server::serve(shared_ptr<tcp::socket> socket, boost::asio::yield_context yield)
+{
+	boost::asio::steady_timer timer(io_service_);
+	timer.expires_from_now(request_timeout);
+	timer.async_wait([socket](const boost::system::error_code& e)
+	{
+		if (!e)
+		{
+			boost::system::error_code ignored;
+			socket->close(ignored);
+		}
+	});
+
+	try
+	{
+		boost::asio::streambuf request(8192);
+		boost::asio::async_read_until(*socket, request, "\r\n\r\n", yield);
+
+		istream in(&request);
+		string method, path;
+		in >> method >> path;
+
+		string status = "200 OK", body;
+		auto handler = handlers_.find(path);
+		if (method != "GET")
+		{
+			status = "405 Method Not Allowed";
+		}
+		else if (handler == handlers_.end())
+		{
+			status = "404 Not Found";
+		}
+		else
+		{
+			ostringstream out;
+			handler->second(out);
+			body = out.str();
+		}
+
+		string response = "HTTP/1.0 " + status + "\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: " + to_string(body.size()) + "\r\n"
+			"Connection: close\r\n\r\n" + body;
+		boost::asio::async_write(*socket, boost::asio::buffer(response), yield);
+	}
+	catch (std::exception& e)
+	{
+		AUTH_LOG(debug) << "metrics request failed because of " << e.what();
+	}
+
+	timer.cancel();
+	boost::system::error_code ignored;
+	socket->shutdown(tcp::socket::shutdown_both, ignored);
+	socket->close(ignored);
+}
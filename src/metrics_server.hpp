@@ -0,0 +1,43 @@
+#ifndef METRICS_SERVER_HPP
+#define METRICS_SERVER_HPP
+
+#include <map>
+#include <memory>
+#include <string>
+#include <ostream>
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/noncopyable.hpp>
+
+//Serves plain text pages like GET /metrics, one HTTP/1.0 request per connection.
+//The text is rendered on the io_service thread, a scrape costs the hot path nothing
+class metrics_server
+	: private boost::noncopyable
+{
+public:
+	typedef std::function<void(std::ostream& out)> collector;
+
+	metrics_server(boost::asio::io_service& io_service, unsigned short port);
+
+	//Serve the text collect writes at path
+	void handle(const std::string& path, collector collect);
+
+private:
+	void start_accept();
+	void serve(std::shared_ptr<boost::asio::ip::tcp::socket> socket, boost::asio::yield_context yield);
+
+	//A request that doesn't arrive in time is dropped
+	static const std::chrono::seconds request_timeout;
+	//A failed accept, such as out of descriptors, is retried after a pause
+	static const std::chrono::milliseconds accept_retry;
+
+	boost::asio::io_service& io_service_;
+	boost::asio::ip::tcp::acceptor acceptor_;
+	std::shared_ptr<boost::asio::ip::tcp::socket> socket_;
+	boost::asio::steady_timer retry_timer_;
+	std::map<std::string, collector> handlers_;
+};
+
+#endif
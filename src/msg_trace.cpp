@@ -0,0 +1,194 @@
+#include "msg_trace.hpp"
+#include "auth_config.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+static const char* const stage_names[TRACE_STAGE_NR] =
+{
+	"body_read", "parsed", "locked", "stored", "persisted",
+	"first_enqueue", "last_enqueue", "first_write", "last_write",
+};
+
+//A finished trace
+struct trace_record
+{
+	uint32_t stages_[TRACE_STAGE_NR];
+	uint32_t peers_;
+};
+
+//The last finished traces of one thread. The mutex is only contended by a summary
+struct trace_ring
+{
+	mutex mutex_;
+	vector<trace_record> records_;
+	size_t capacity_ = 1;
+	size_t next_ = 0;
+	bool free_ = false;
+};
+
+static vector<trace_ring*>& rings()
+{
+	static vector<trace_ring*> all;
+	return all;
+}
+
+static mutex& rings_mutex()
+{
+	static mutex m;
+	return m;
+}
+
+//A ring outlives its thread and is handed to the next new thread
+struct ring_holder
+{
+	trace_ring* ring_ = nullptr;
+
+	ring_holder()
+	{
+		lock_guard<mutex> lock(rings_mutex());
+		for (auto r : rings())
+		{
+			if (r->free_)
+			{
+				r->free_ = false;
+				ring_ = r;
+				return;
+			}
+		}
+		ring_ = new trace_ring;
+		ring_->capacity_ = max<uint32_t>(
+			boost::serialization::singleton<auth_config>::get_const_instance().trace_ring_size_, 1);
+		ring_->records_.reserve(ring_->capacity_);
+		rings().push_back(ring_);
+	}
+
+	~ring_holder()
+	{
+		lock_guard<mutex> lock(rings_mutex());
+		ring_->free_ = true;
+	}
+};
+
+static thread_local msg_trace* current_trace = nullptr;
+
+trace_ptr msg_trace::sample()
+{
+	static thread_local uint32_t count = 0;
+	uint32_t rate = boost::serialization::singleton<auth_config>::get_const_instance().trace_sample_rate_;
+	if (rate == 0 || ++count < rate)
+		return trace_ptr();
+	count = 0;
+	return make_shared<msg_trace>();
+}
+
+msg_trace::msg_trace()
+	: start_(steady_clock::now()),
+	peers_(0)
+{
+	for (auto& stage : stages_)
+		stage.store(unset, memory_order_relaxed);
+}
+
+msg_trace::~msg_trace()
+{
+	static thread_local ring_holder holder;
+	trace_ring& ring = *holder.ring_;
+
+	trace_record record;
+	for (size_t i = 0; i < TRACE_STAGE_NR; i++)
+		record.stages_[i] = stages_[i].load(memory_order_relaxed);
+	record.peers_ = peers_.load(memory_order_relaxed);
+
+	lock_guard<mutex> lock(ring.mutex_);
+	if (ring.records_.size() < ring.capacity_)
+		ring.records_.push_back(record);
+	else
+		ring.records_[ring.next_] = record;
+	ring.next_ = (ring.next_ + 1) % ring.capacity_;
+}
+
+uint32_t msg_trace::elapsed_us() const
+{
+	auto us = duration_cast<microseconds>(steady_clock::now() - start_).count();
+	return static_cast<uint32_t>(min<int64_t>(us, unset - 1));
+}
+
+void msg_trace::mark(Trace_Stage stage)
+{
+	stages_[stage].store(elapsed_us(), memory_order_relaxed);
+}
+
+void msg_trace::mark_peer(Trace_Stage first, Trace_Stage last)
+{
+	uint32_t us = elapsed_us();
+	if (first == TRACE_FIRST_ENQUEUE)
+		peers_.fetch_add(1, memory_order_relaxed);
+
+	uint32_t v = stages_[first].load(memory_order_relaxed);
+	while ((v == unset || us < v) && !stages_[first].compare_exchange_weak(v, us, memory_order_relaxed));
+	v = stages_[last].load(memory_order_relaxed);
+	while ((v == unset || us > v) && !stages_[last].compare_exchange_weak(v, us, memory_order_relaxed));
+}
+
+msg_trace* msg_trace::current()
+{
+	return current_trace;
+}
+
+msg_trace::scope::scope(msg_trace* trace)
+	: previous_(current_trace)
+{
+	current_trace = trace;
+}
+
+msg_trace::scope::~scope()
+{
+	current_trace = previous_;
+}
+
+void msg_trace::summary(ostream& out)
+{
+	vector<trace_record> records;
+	{
+		lock_guard<mutex> lock(rings_mutex());
+		for (auto r : rings())
+		{
+			lock_guard<mutex> ring_lock(r->mutex_);
+			records.insert(records.end(), r->records_.begin(), r->records_.end());
+		}
+	}
+
+	uint64_t peers = 0;
+	for (auto& record : records)
+		peers += record.peers_;
+	out << records.size() << " traces, " << (records.empty() ? 0 : peers / records.size())
+		<< " participants on average, microseconds since the header was read\n";
+
+	const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	out << left << setw(16) << "stage" << right << setw(10) << "count";
+	for (const char* name : { "p50", "p90", "p99", "p99.9", "max" })
+		out << setw(12) << name;
+	out << '\n';
+
+	vector<uint32_t> values;
+	for (size_t s = 0; s < TRACE_STAGE_NR; s++)
+	{
+		values.clear();
+		for (auto& record : records)
+		{
+			if (record.stages_[s] != unset)
+				values.push_back(record.stages_[s]);
+		}
+		sort(values.begin(), values.end());
+
+		out << left << setw(16) << stage_names[s] << right << setw(10) << values.size();
+		for (double q : quantiles)
+			out << setw(12) << (values.empty() ? 0 : values[min(values.size() - 1, size_t(q * values.size()))]);
+		out << setw(12) << (values.empty() ? 0 : values.back()) << '\n';
+	}
+}
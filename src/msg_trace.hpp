@@ -0,0 +1,74 @@
+#ifndef MSG_TRACE_HPP
+#define MSG_TRACE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <boost/noncopyable.hpp>
+
+//Stages of a traced msg, every one is the time since its header was read
+enum Trace_Stage
+{
+	TRACE_BODY_READ,	//body read
+	TRACE_PARSED,		//body decoded
+	TRACE_LOCKED,		//group lock taken
+	TRACE_STORED,		//stored and posted to the participants' strands
+	TRACE_PERSISTED,	//queued for the storage and the local store
+	TRACE_FIRST_ENQUEUE,//first participant queued it
+	TRACE_LAST_ENQUEUE,
+	TRACE_FIRST_WRITE,	//first participant's write completed
+	TRACE_LAST_WRITE,
+	TRACE_STAGE_NR
+};
+
+//Latency of one sampled client msg from its header read to its last fanout write.
+//The frames fanned out hold the trace, so it completes when the last participant
+//has written them; it then goes to a ring buffer of the thread that finished it.
+class msg_trace
+	: public std::enable_shared_from_this<msg_trace>,
+	private boost::noncopyable
+{
+public:
+	//A trace of every trace_sample_rate-th msg read by this thread, null for the others
+	static std::shared_ptr<msg_trace> sample();
+
+	msg_trace();
+	~msg_trace();
+
+	//A stage reached once, by the thread processing the msg
+	void mark(Trace_Stage stage);
+
+	//A participant queued or wrote the msg, the first and the last one are kept
+	void mark_peer(Trace_Stage first, Trace_Stage last);
+
+	//The trace of the msg this thread is processing, for the group code it calls
+	static msg_trace* current();
+
+	class scope
+		: private boost::noncopyable
+	{
+	public:
+		explicit scope(msg_trace* trace);
+		~scope();
+	private:
+		msg_trace* previous_;
+	};
+
+	//Percentiles of every stage over the traces in the ring buffers
+	static void summary(std::ostream& out);
+
+private:
+	static const uint32_t unset = UINT32_MAX;
+
+	uint32_t elapsed_us() const;
+
+	std::chrono::steady_clock::time_point start_;
+	std::atomic<uint32_t> stages_[TRACE_STAGE_NR];
+	std::atomic<uint32_t> peers_;
+};
+
+typedef std::shared_ptr<msg_trace> trace_ptr;
+
+#endif
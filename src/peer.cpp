@@ -0,0 +1,535 @@
+#include "peer.hpp"
+#include "server.hpp"
+#include "auth_config.hpp"
+#include "md5.hpp"
+#include "metrics.hpp"
+#include "byte_order.hpp"
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include "async_log.hpp"
+
+using namespace std;
+using boost::asio::ip::tcp;
+using boost::asio::async_read;
+using boost::asio::async_write;
+using boost::asio::detail::socket_ops::host_to_network_short;
+using boost::asio::detail::socket_ops::network_to_host_short;
+
+static string chap_of(const string& challenge)
+{
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+
+	uint8_t ret[16];
+	md5 md5;
+	string comp = challenge + config.server_pwd_;
+	md5.md5_once(const_cast<char*>(comp.data()), comp.size(), ret);
+	return string(reinterpret_cast<char*>(ret), 16);
+}
+
+static const size_t max_body_len = 65535;
+static const size_t challenge_len = 16;
+//mac[6] attr[2] duration[4] auth_time[4] res1[4] res2[4]
+static const size_t update_record_len = 24;
+//gid[4] digest[8]
+static const size_t digest_entry_len = 12;
+
+const chrono::seconds peer_manager::redial_interval(5);
+
+peer_session::peer_session(tcp::socket socket, boost::asio::io_service& io_service,
+	peer_manager& manager, const string& peer)
+	: socket_(move(socket)),
+	strand_(io_service),
+	manager_(manager),
+	outgoing_(!peer.empty()),
+	peer_str_(peer)
+{
+}
+
+void peer_session::start()
+{
+	spawn(strand_, bind(&peer_session::run, shared_from_this(), placeholders::_1));
+}
+
+void peer_session::run(boost::asio::yield_context yield)
+{
+	bool added = false;
+	try
+	{
+		if (!outgoing_)
+		{
+			peer_str_ = socket_.remote_endpoint().address().to_string()
+				+ ":" + std::to_string(socket_.remote_endpoint().port());
+		}
+
+		handshake(yield);
+		manager_.add(shared_from_this());
+		added = true;
+		AUTH_LOG(info) << "peer " << peer_str_ << " is certified";
+
+		//A fresh link starts an anti-entropy round at once
+		if (outgoing_)
+			manager_.send_digests(shared_from_this());
+
+		vector<char> body;
+		for (;;)
+		{
+			uint8_t type = read_msg(body, yield);
+			manager_.handle_msg(shared_from_this(), type, body);
+		}
+	}
+	catch (std::exception& e)
+	{
+		AUTH_LOG(error) << "peer " << peer_str_ << " closed because of " << e.what();
+	}
+
+	close();
+	manager_.remove(shared_from_this(), added);
+}
+
+void peer_session::handshake(boost::asio::yield_context& yield)
+{
+	vector<char> body;
+	if (outgoing_)
+	{
+		if (read_msg(body, yield) != PEER_HELLO || body.size() != challenge_len)
+			throw runtime_error("peer hello error");
+		frame_ptr frame = peer_manager::make_frame(PEER_HELLO, chap_of(string(body.begin(), body.end())));
+		async_write(socket_, boost::asio::buffer(*frame), yield);
+	}
+	else
+	{
+		random_device rd;
+		string challenge;
+		for (size_t i = 0; i < challenge_len; i++)
+			challenge.push_back(static_cast<char>(rd()));
+
+		frame_ptr frame = peer_manager::make_frame(PEER_HELLO, challenge);
+		async_write(socket_, boost::asio::buffer(*frame), yield);
+
+		if (read_msg(body, yield) != PEER_HELLO || body.size() != challenge_len
+			|| chap_of(challenge).compare(0, 16, &body[0], 16) != 0)
+			throw runtime_error("peer chap error");
+	}
+}
+
+uint8_t peer_session::read_msg(vector<char>& body, boost::asio::yield_context& yield)
+{
+	header head;
+	async_read(socket_, boost::asio::buffer(&head, sizeof(head)), yield);
+
+	if (head.version_ != MSG_VERSION_BINARY || head.type_ < PEER_HELLO || head.type_ > PEER_CHUNKS)
+		throw runtime_error("peer msg header error");
+
+	body.resize(network_to_host_short(head.len_));
+	if (!body.empty())
+		async_read(socket_, boost::asio::buffer(body), yield);
+	metrics::frame_in(head.type_, sizeof(head) + body.size());
+	return head.type_;
+}
+
+void peer_session::send(frame_ptr frame)
+{
+	auto self = shared_from_this();
+	strand_.post([this, self, frame]()
+	{
+		const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+
+		//A slow peer loses the oldest frames, the next anti-entropy round repairs them.
+		//The front one is being written while writing_, with nothing queued behind it
+		//the new frame is the one dropped
+		if (!send_queue_.empty() && send_queue_.size() >= config.send_queue_max_)
+		{
+			if (!writing_)
+				send_queue_.pop_front();
+			else if (send_queue_.size() > 1)
+				send_queue_.erase(send_queue_.begin() + 1);
+			else
+				return;
+		}
+		send_queue_.push_back(frame);
+
+		if (!writing_)
+			do_write();
+	});
+}
+
+void peer_session::close()
+{
+	boost::system::error_code ignored;
+	socket_.close(ignored);
+}
+
+void peer_session::do_write()
+{
+	writing_ = true;
+	metrics::frame_out(static_cast<uint8_t>((*send_queue_.front())[1]), send_queue_.front()->size());
+	async_write(socket_, boost::asio::buffer(*send_queue_.front()),
+		strand_.wrap(bind(&peer_session::handle_write, shared_from_this(), placeholders::_1)));
+}
+
+void peer_session::handle_write(const boost::system::error_code& e)
+{
+	send_queue_.pop_front();
+	if (e)
+	{
+		//The read loop sees the closed socket and removes the session
+		send_queue_.clear();
+		writing_ = false;
+		close();
+		return;
+	}
+
+	if (send_queue_.empty())
+		writing_ = false;
+	else
+		do_write();
+}
+
+peer_manager::peer_manager(boost::asio::io_service& io_service, server& server, unsigned short port,
+	const vector<string>& peers, chrono::seconds interval)
+	: io_service_(io_service),
+	server_(server),
+	port_(port),
+	peers_(peers),
+	interval_(interval),
+	acceptor_(io_service),
+	round_timer_(io_service)
+{
+}
+
+void peer_manager::start()
+{
+	if (port_)
+	{
+		tcp::endpoint endpoint(tcp::v4(), port_);
+		acceptor_.open(endpoint.protocol());
+		acceptor_.set_option(tcp::acceptor::reuse_address(true));
+		acceptor_.bind(endpoint);
+		acceptor_.listen();
+		start_accept();
+	}
+
+	for (auto& peer : peers_)
+		spawn(io_service_, bind(&peer_manager::dial, this, peer, false, placeholders::_1));
+
+	start_round();
+}
+
+void peer_manager::replicate(unsigned gid, const vector<auth_info>& auths)
+{
+	vector<peer_session_ptr> targets;
+	{
+		lock_guard<mutex> lock(mutex_);
+		for (auto& session : sessions_)
+		{
+			if (session->outgoing())
+				targets.push_back(session);
+		}
+	}
+	if (targets.empty() || auths.empty())
+		return;
+
+	auto frames = update_frames(gid, auths);
+	for (auto& session : targets)
+	{
+		for (auto& frame : frames)
+			session->send(frame);
+	}
+}
+
+frame_ptr peer_manager::make_frame(Msg_Type type, const string& body)
+{
+	header head;
+	head.version_ = MSG_VERSION_BINARY;
+	head.type_ = type;
+	head.len_ = host_to_network_short(body.size());
+	head.res1_ = 0;
+	head.res2_ = 0;
+
+	auto frame = make_shared<string>(reinterpret_cast<const char*>(&head), sizeof(head));
+	frame->append(body);
+	return frame;
+}
+
+vector<frame_ptr> peer_manager::update_frames(unsigned gid, const vector<auth_info>& auths)
+{
+	//gid[4] count[2] records
+	const size_t per_frame = (max_body_len - 6) / update_record_len;
+
+	vector<frame_ptr> frames;
+	for (size_t i = 0; i < auths.size(); i += per_frame)
+	{
+		size_t n = min(per_frame, auths.size() - i);
+		string body;
+		body.reserve(6 + n * update_record_len);
+		put_uint32(body, gid);
+		put_uint16(body, n);
+		for (size_t j = i; j < i + n; j++)
+		{
+			const auth_info& auth = auths[j];
+			uint8_t mac[6];
+			if (!auth_message::mac_to_bytes(auth.mac_, mac))
+				memset(mac, 0, sizeof(mac));
+			body.append(reinterpret_cast<char*>(mac), 6);
+			put_uint16(body, auth.attr_);
+			put_uint32(body, auth.duration_);
+			put_uint32(body, auth.auth_time_);
+			put_uint32(body, auth.res1_);
+			put_uint32(body, auth.res2_);
+		}
+		frames.push_back(make_frame(PEER_UPDATE, body));
+	}
+	return frames;
+}
+
+void peer_manager::start_accept()
+{
+	socket_.reset(new tcp::socket(io_service_));
+	acceptor_.async_accept(*socket_, [this](const boost::system::error_code& e)
+	{
+		if (!e)
+			make_shared<peer_session>(move(*socket_), io_service_, *this, string())->start();
+		start_accept();
+	});
+}
+
+void peer_manager::dial(const string& peer, bool redial, boost::asio::yield_context yield)
+{
+	auto colon = peer.rfind(':');
+	if (colon == string::npos)
+	{
+		AUTH_LOG(error) << "peer " << peer << " is not host:port";
+		return;
+	}
+
+	tcp::resolver resolver(io_service_);
+	boost::asio::steady_timer timer(io_service_);
+	bool logged = false;
+	boost::system::error_code ec;
+	if (redial)
+	{
+		timer.expires_from_now(redial_interval);
+		timer.async_wait(yield[ec]);
+	}
+
+	for (;;)
+	{
+		tcp::socket socket(io_service_);
+		auto endpoints = resolver.async_resolve(tcp::resolver::query(peer.substr(0, colon), peer.substr(colon + 1)), yield[ec]);
+		if (!ec)
+			boost::asio::async_connect(socket, endpoints, yield[ec]);
+		if (!ec)
+		{
+			make_shared<peer_session>(move(socket), io_service_, *this, peer)->start();
+			return;
+		}
+
+		if (!logged)
+		{
+			logged = true;
+			AUTH_LOG(warning) << "peer " << peer << " connect failed because of " << ec.message() << ", retrying";
+		}
+		timer.expires_from_now(redial_interval);
+		timer.async_wait(yield[ec]);
+	}
+}
+
+void peer_manager::start_round()
+{
+	round_timer_.expires_from_now(interval_);
+	round_timer_.async_wait(bind(&peer_manager::handle_round, this, placeholders::_1));
+}
+
+void peer_manager::handle_round(const boost::system::error_code& e)
+{
+	if (e)
+		return;
+
+	send_digests(peer_session_ptr());
+	start_round();
+}
+
+void peer_manager::send_digests(const peer_session_ptr& session)
+{
+	vector<peer_session_ptr> targets;
+	if (session)
+	{
+		targets.push_back(session);
+	}
+	else
+	{
+		lock_guard<mutex> lock(mutex_);
+		for (auto& s : sessions_)
+		{
+			if (s->outgoing())
+				targets.push_back(s);
+		}
+	}
+	if (targets.empty())
+		return;
+
+	//count[2] entries, empty groups are left out, the peer sends its own digests for those
+	const size_t per_frame = (max_body_len - 2) / digest_entry_len;
+	vector<frame_ptr> frames;
+	string body;
+	size_t count = 0;
+	auto flush = [&]()
+	{
+		body[0] = static_cast<char>(count >> 8);
+		body[1] = static_cast<char>(count & 0xff);
+		frames.push_back(make_frame(PEER_DIGEST, body));
+		body.assign(2, 0);
+		count = 0;
+	};
+
+	body.assign(2, 0);
+	server_.groups().for_each([&](unsigned gid, auth_group& group)
+	{
+		uint64_t digest = group.digest();
+		if (!digest)
+			return;
+		put_uint32(body, gid);
+		put_uint64(body, digest);
+		if (++count == per_frame)
+			flush();
+	});
+	if (count)
+		flush();
+
+	for (auto& target : targets)
+	{
+		for (auto& frame : frames)
+			target->send(frame);
+	}
+}
+
+void peer_manager::handle_msg(const peer_session_ptr& session, uint8_t type, const vector<char>& body)
+{
+	switch (type)
+	{
+	case PEER_UPDATE:
+		handle_update(body);
+		break;
+	case PEER_DIGEST:
+		handle_digest(session, body);
+		break;
+	case PEER_CHUNKS:
+		handle_chunks(session, body);
+		break;
+	default:
+		AUTH_LOG(error) << "peer " << session->to_string() << " send an invalid msg type";
+	}
+}
+
+void peer_manager::handle_update(const vector<char>& body)
+{
+	if (body.size() < 6)
+		throw runtime_error("peer update length error");
+
+	unsigned gid = get_uint32(&body[0]);
+	size_t count = get_uint16(&body[4]);
+	if (body.size() != 6 + count * update_record_len)
+		throw runtime_error("peer update length error");
+	if (!server_.owns(gid))
+		return;
+
+	vector<auth_info> auths(count);
+	const char* p = &body[6];
+	for (auto& auth : auths)
+	{
+		auth.mac_ = auth_message::bytes_to_mac(reinterpret_cast<const uint8_t*>(p));
+		auth.attr_ = get_uint16(p + 6);
+		auth.duration_ = get_uint32(p + 8);
+		auth.auth_time_ = get_uint32(p + 12);
+		auth.res1_ = get_uint32(p + 16);
+		auth.res2_ = get_uint32(p + 20);
+		p += update_record_len;
+	}
+
+	//Only what won the merge is persisted, and it isn't pushed on again
+	while (!server_.group(gid).merge(auths))
+		;
+	if (!auths.empty())
+		server_.persist(gid, auths, false);
+}
+
+void peer_manager::handle_digest(const peer_session_ptr& session, const vector<char>& body)
+{
+	if (body.size() < 2 || body.size() != 2 + get_uint16(&body[0]) * digest_entry_len)
+		throw runtime_error("peer digest length error");
+
+	uint64_t chunks[auth_group::digest_chunks];
+	for (size_t off = 2; off < body.size(); off += digest_entry_len)
+	{
+		unsigned gid = get_uint32(&body[off]);
+		uint64_t digest = get_uint64(&body[off + 4]);
+		if (!server_.owns(gid))
+			continue;
+
+		//A missing group isn't created, its chunks are all empty
+		auth_group* group = server_.groups().find(gid);
+		if (group && group->digest() == digest)
+			continue;
+
+		string reply;
+		reply.reserve(4 + sizeof(chunks));
+		put_uint32(reply, gid);
+		if (group)
+			group->chunk_digests(chunks);
+		else
+			memset(chunks, 0, sizeof(chunks));
+		for (auto chunk : chunks)
+			put_uint64(reply, chunk);
+		session->send(make_frame(PEER_CHUNKS, reply));
+	}
+}
+
+void peer_manager::handle_chunks(const peer_session_ptr& session, const vector<char>& body)
+{
+	if (body.size() != 4 + auth_group::digest_chunks * 8)
+		throw runtime_error("peer chunks length error");
+
+	unsigned gid = get_uint32(&body[0]);
+	auth_group* group = server_.groups().find(gid);
+	if (!group)
+		return;
+
+	uint64_t chunks[auth_group::digest_chunks];
+	group->chunk_digests(chunks);
+
+	uint64_t mask = 0;
+	for (size_t i = 0; i < auth_group::digest_chunks; i++)
+	{
+		if (chunks[i] != get_uint64(&body[4 + i * 8]))
+			mask |= uint64_t(1) << i;
+	}
+	if (!mask)
+		return;
+
+	vector<auth_info> auths;
+	group->chunk_records(mask, auths);
+	AUTH_LOG(debug) << "anti-entropy pushes " << auths.size() << " records of group " << gid
+		<< " to peer " << session->to_string();
+	for (auto& frame : update_frames(gid, auths))
+		session->send(frame);
+}
+
+void peer_manager::add(const peer_session_ptr& session)
+{
+	lock_guard<mutex> lock(mutex_);
+	sessions_.insert(session);
+}
+
+void peer_manager::remove(const peer_session_ptr& session, bool added)
+{
+	if (added)
+	{
+		lock_guard<mutex> lock(mutex_);
+		sessions_.erase(session);
+	}
+
+	//Keep dialing a configured peer
+	if (session->outgoing())
+		spawn(io_service_, bind(&peer_manager::dial, this, session->to_string(), true, placeholders::_1));
+}
@@ -0,0 +1,122 @@
+#ifndef PEER_HPP
+#define PEER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/noncopyable.hpp>
+#include "auth_message.hpp"
+
+class server;
+class peer_manager;
+
+//One server to server link. The accepting side sends a PEER_HELLO challenge and the
+//dialing side answers it with the md5 of the challenge and server_pwd, like clients do.
+//All peer msgs are binary.
+class peer_session
+	: public std::enable_shared_from_this<peer_session>,
+	private boost::noncopyable
+{
+public:
+	//peer is the configured address of a dialed peer, empty for an accepted one
+	peer_session(boost::asio::ip::tcp::socket socket, boost::asio::io_service& io_service,
+		peer_manager& manager, const std::string& peer);
+
+	//Handshake and read msgs on the strand until the link fails
+	void start();
+
+	//Queue a frame, called from any thread
+	void send(frame_ptr frame);
+
+	void close();
+
+	bool outgoing() const { return outgoing_; }
+	const std::string& to_string() const { return peer_str_; }
+
+private:
+	void run(boost::asio::yield_context yield);
+	void handshake(boost::asio::yield_context& yield);
+
+	//Read one msg, a binary peer msg or an exception
+	uint8_t read_msg(std::vector<char>& body, boost::asio::yield_context& yield);
+
+	void do_write();
+	void handle_write(const boost::system::error_code& e);
+
+	boost::asio::ip::tcp::socket socket_;
+	boost::asio::io_service::strand strand_;
+	peer_manager& manager_;
+	bool outgoing_;
+	std::string peer_str_;
+
+	std::deque<frame_ptr> send_queue_;
+	bool writing_ = false;
+};
+
+typedef std::shared_ptr<peer_session> peer_session_ptr;
+
+//Replication between servers. Every server dials the peers it is configured with and
+//pushes its own changes over those links; records are merged last writer wins by auth_time_.
+//Anti-entropy repairs what a push missed: every interval a server sends its group digests,
+//the peer answers the differing groups with their chunk digests, and the server pushes
+//the records of the differing chunks. A server that just (re)connected starts a round at once.
+class peer_manager
+	: private boost::noncopyable
+{
+public:
+	peer_manager(boost::asio::io_service& io_service, server& server, unsigned short port,
+		const std::vector<std::string>& peers, std::chrono::seconds interval);
+
+	void start();
+
+	//Push a local change to the peers
+	void replicate(unsigned gid, const std::vector<auth_info>& auths);
+
+private:
+	friend class peer_session;
+
+	static frame_ptr make_frame(Msg_Type type, const std::string& body);
+	static std::vector<frame_ptr> update_frames(unsigned gid, const std::vector<auth_info>& auths);
+
+	void start_accept();
+	//Connect to a configured peer, retrying until it answers; redial waits first
+	void dial(const std::string& peer, bool redial, boost::asio::yield_context yield);
+	void start_round();
+	void handle_round(const boost::system::error_code& e);
+
+	//Send the group digests to one peer, or to every dialed peer when session is null
+	void send_digests(const peer_session_ptr& session);
+
+	//Msgs of a session, called on its strand
+	void handle_msg(const peer_session_ptr& session, uint8_t type, const std::vector<char>& body);
+	void handle_update(const std::vector<char>& body);
+	void handle_digest(const peer_session_ptr& session, const std::vector<char>& body);
+	void handle_chunks(const peer_session_ptr& session, const std::vector<char>& body);
+
+	void add(const peer_session_ptr& session);
+	//A closed session, added if it had been certified; a dialed peer is dialed again
+	void remove(const peer_session_ptr& session, bool added);
+
+	static const std::chrono::seconds redial_interval;
+
+	boost::asio::io_service& io_service_;
+	server& server_;
+	unsigned short port_;
+	std::vector<std::string> peers_;
+	std::chrono::seconds interval_;
+
+	boost::asio::ip::tcp::acceptor acceptor_;
+	std::shared_ptr<boost::asio::ip::tcp::socket> socket_;
+	boost::asio::steady_timer round_timer_;
+
+	std::set<peer_session_ptr> sessions_;
+	std::mutex mutex_;
+};
+
+#endif
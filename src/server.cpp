@@ -8,20 +8,24 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 #include <signal.h>
-#include <thread>
+#include <algorithm>
 #include "server.hpp"
-#include <boost/log/trivial.hpp>
+#include "auth_config.hpp"
+#include "metrics.hpp"
+#include "msg_trace.hpp"
+#include "buffer_pool.hpp"
+#include "async_log.hpp"
 
 
 using namespace std;
 using boost::asio::ip::tcp;
 
-server::server(const size_t port, size_t thread_pool_size,sync_db& db)
-	: mysql_db_(db),
-	thread_pool_size_(thread_pool_size),
-	signals_(io_service_),
-	acceptor_(io_service_,tcp::endpoint(tcp::v4(), port)),
-	socket_(io_service_)
+server::server(const size_t port, size_t thread_pool_size, bool per_core, bool cpu_affinity, storage& db)
+	: db_(db),
+	io_service_pool_(thread_pool_size, per_core, cpu_affinity),
+	signals_(io_service_pool_.get_io_service(0)),
+	groups_([this](unsigned gid) { return new auth_group(gid, *expiry_wheels_[gid % expiry_wheels_.size()]); }),
+	reclaim_timer_(io_service_pool_.get_io_service(0))
 {
 	// Register to handle the signals that indicate when the server should exit.
 	signals_.add(SIGINT);
@@ -31,73 +35,293 @@ server::server(const size_t port, size_t thread_pool_size,sync_db& db)
 
 	signals_.async_wait(bind(&server::handle_stop, this));
 
-	start_accept();
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+	// The local storage already is a local store
+	if (!config.local_store_dir_.empty() && config.storage_ != STORAGE_LOCAL)
+	{
+		local_store_.reset(new local_store(config.local_store_dir_, chrono::milliseconds(config.journal_sync_interval_),
+			chrono::seconds(config.snapshot_interval_)));
+	}
+
+	if (!config.cluster_nodes_.empty())
+	{
+		ring_.reset(new cluster_ring(config.cluster_nodes_, config.cluster_self_, config.cluster_vnodes_));
+		AUTH_LOG(info) << "cluster node " << config.cluster_self_ << " owns "
+			<< ring_->share() * 100 << "% of the gids";
+	}
+
+	if (config.peer_port_ || !config.peers_.empty())
+	{
+		peers_.reset(new peer_manager(io_service_pool_.get_io_service(0), *this, config.peer_port_, config.peers_,
+			chrono::seconds(config.anti_entropy_interval_)));
+	}
+
+	if (config.metrics_port_)
+	{
+		metrics_server_.reset(new metrics_server(io_service_pool_.get_io_service(0), config.metrics_port_));
+		metrics_server_->handle("/metrics", bind(&server::collect_metrics, this, placeholders::_1));
+		metrics_server_->handle("/traces", &msg_trace::summary);
+	}
+
+	// Every shard listens on the same port, the kernel spreads the new connections
+	tcp::endpoint endpoint(tcp::v4(), port);
+	for (size_t i = 0; i < io_service_pool_.size(); ++i)
+	{
+		open_acceptor(i, endpoint);
+		start_accept(i);
+
+		expiry_wheels_.push_back(make_shared<expiry_wheel>(io_service_pool_.get_io_service(i),
+			bind(&server::handle_expire, this, placeholders::_1)));
+	}
 }
 
 void server::run()
 {
-	mysql_db_.load_auth_info(memory_db_);
-
-	// Create a pool of threads to run all of the io_services.
-	vector<shared_ptr<thread> > threads;
-	for (size_t i = 0; i < thread_pool_size_; ++i)
+	// Only the gids this server owns are loaded
+	storage::group_lookup group = [this](unsigned gid) { return owns(gid) ? &groups_.get(gid) : nullptr; };
+	// MySQL can make up for an unusable snapshot, with no storage the store is all there is
+	bool fallback = boost::serialization::singleton<auth_config>::get_const_instance().storage_ == STORAGE_MYSQL;
+	if (local_store_ && local_store_->restore(group, fallback))
 	{
-		shared_ptr<thread> thread(new std::thread([this]() 
-		{ 
-			while (true)
+		// Serve what the local store had, records MySQL has newer are merged in later
+		reconcile_thread_ = thread([this, group]()
+		{
+			try
 			{
-				try
-				{
-					io_service_.run();
-					break;
-				}
-				catch (std::exception&e)
-				{
-					BOOST_LOG_TRIVIAL(error) << "io_service_.run() exception:" << e.what();
-				}
+				db_.load(group);
 			}
-			
-			 }));
-		threads.push_back(thread);
+			catch (const exception& e)
+			{
+				AUTH_LOG(error) << "Reconcile with database error:" << e.what();
+			}
+		});
+	}
+	else
+	{
+		db_.load(group);
+	}
+	db_.start(bind(&server::dump, this, placeholders::_1));
+	if (local_store_)
+		local_store_->start(bind(&server::dump, this, placeholders::_1));
+
+	for (auto& wheel : expiry_wheels_)
+		wheel->start();
+	start_reclaim();
+	if (peers_)
+		peers_->start();
+
+	AUTH_LOG(info) << "server start success!!";
+
+	io_service_pool_.run();
+
+	if (reconcile_thread_.joinable())
+		reconcile_thread_.join();
+	db_.stop();
+	if (local_store_)
+		local_store_->stop();
+}
+
+void server::open_acceptor(size_t shard, const tcp::endpoint& endpoint)
+{
+	typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+
+	acceptor_ptr acceptor(new tcp::acceptor(io_service_pool_.get_io_service(shard)));
+	acceptor->open(endpoint.protocol());
+	acceptor->set_option(tcp::acceptor::reuse_address(true));
+	if (io_service_pool_.size() > 1)
+	{
+		acceptor->set_option(reuse_port(true));
 	}
+	acceptor->bind(endpoint);
+	acceptor->listen();
 
-	BOOST_LOG_TRIVIAL(info) << "server start success!!";
-	// Wait for all threads in the pool to exit.
-	for (size_t i = 0; i < threads.size(); ++i)
-		threads[i]->join();
+	acceptors_.push_back(acceptor);
+	sockets_.push_back(socket_ptr());
 }
 
-void server::start_accept()
+void server::start_accept(size_t shard)
 {
-	acceptor_.async_accept(socket_,bind(&server::handle_accept, this, placeholders::_1));
+	sockets_[shard].reset(new tcp::socket(io_service_pool_.get_io_service(shard)));
+	acceptors_[shard]->async_accept(*sockets_[shard], bind(&server::handle_accept, this, shard, placeholders::_1));
 }
 
-void server::handle_accept(const boost::system::error_code& e)
+void server::handle_accept(size_t shard, const boost::system::error_code& e)
 {
 	if (!e)
 	{
-		auto conn = std::make_shared<connection>(std::move(socket_),this);
+		// The connection stays on the shard that accepted it
+		auto conn = std::make_shared<connection>(std::move(*sockets_[shard]), io_service_pool_.get_io_service(shard), this);
 		conn->start();
-		BOOST_LOG_TRIVIAL(info) << "new client arrived!!";
+		AUTH_LOG(info) << "new client arrived!!";
 	}
 
-	start_accept();
+	start_accept(shard);
 }
 
 void server::handle_stop()
 {
-	io_service_.stop();
-	memory_db_.clear();
-	BOOST_LOG_TRIVIAL(info) << "recv stop signal";
+	io_service_pool_.stop();
+	AUTH_LOG(info) << "recv stop signal";
 }
 
-sync_db& server::get_db()
+storage& server::get_db()
 {
-	return mysql_db_;
+	return db_;
 }
 
 auth_group& server::group(unsigned gid)
 {
-	lock_guard<mutex> lock(mutex_);
-	return memory_db_[gid];
+	return groups_.get(gid);
+}
+
+group_registry& server::groups()
+{
+	return groups_;
+}
+
+bool server::owns(unsigned gid) const
+{
+	return !ring_ || ring_->owns(gid);
+}
+
+const cluster_node* server::redirect_of(unsigned gid) const
+{
+	return ring_ && !ring_->owns(gid) ? &ring_->owner(gid) : nullptr;
+}
+
+void server::persist(unsigned gid, const auth_info& auth)
+{
+	db_.insert(gid, auth);
+	if (local_store_ || peers_)
+	{
+		vector<auth_info> auths(1, auth);
+		if (local_store_)
+			local_store_->put(gid, auths);
+		if (peers_)
+			peers_->replicate(gid, auths);
+	}
+}
+
+void server::persist(unsigned gid, const vector<auth_info>& auths, bool replicate)
+{
+	db_.insert(gid, auths);
+	if (local_store_)
+		local_store_->put(gid, auths);
+	if (peers_ && replicate)
+		peers_->replicate(gid, auths);
+}
+
+void server::dump(const local_store::record_sink& sink)
+{
+	vector<auth_info> auths;
+	groups_.for_each([&sink, &auths](unsigned gid, auth_group& group)
+	{
+		auths.clear();
+		group.records(auths);
+		if (!auths.empty())
+			sink(gid, auths);
+	});
+}
+
+void server::handle_expire(vector<expiry_entry>& expired)
+{
+	sort(expired.begin(), expired.end(), [](const expiry_entry& a, const expiry_entry& b) { return a.gid_ < b.gid_; });
+
+	size_t count = 0;
+	vector<pair<unsigned, uint64_t> > records;
+	vector<expiry_entry> entries;
+	for (auto it = expired.begin(); it != expired.end();)
+	{
+		unsigned gid = it->gid_;
+		entries.clear();
+		for (; it != expired.end() && it->gid_ == gid; ++it)
+			entries.push_back(*it);
+
+		auth_group* group = groups_.find(gid);
+		if (!group)
+			continue;
+
+		//Queued under the group lock, a re-auth's put can only be queued after the delete
+		group->expire(entries, [&](const vector<uint64_t>& erased)
+		{
+			records.clear();
+			for (auto mac : erased)
+				records.push_back(make_pair(gid, mac));
+			db_.erase(records);
+			if (local_store_)
+				local_store_->erase(records);
+			count += records.size();
+		});
+	}
+
+	if (count)
+		AUTH_LOG(debug) << "expire " << count << " records";
+}
+
+void server::collect_metrics(ostream& out)
+{
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+
+	metrics::write(out);
+	db_.report(out);
+	if (local_store_)
+	{
+		metrics::write_header(out, "ik_auth_journal_pending_bytes", "gauge", "Journaled bytes not written yet");
+		out << "ik_auth_journal_pending_bytes " << local_store_->pending() << '\n';
+	}
+
+	const overflow_counters& overflow = connection::overflow_stats();
+	metrics::write_header(out, "ik_auth_overflow_total", "counter", "Slow consumer msgs dropped, collapsed and connections closed");
+	out << "ik_auth_overflow_total{action=\"dropped\"} " << overflow.dropped_ << '\n';
+	out << "ik_auth_overflow_total{action=\"collapsed\"} " << overflow.collapsed_ << '\n';
+	out << "ik_auth_overflow_total{action=\"disconnected\"} " << overflow.disconnected_ << '\n';
+
+	metrics::write_header(out, "ik_auth_log_dropped_total", "counter", "Log records dropped because a thread's log queue was full");
+	out << "ik_auth_log_dropped_total " << async_log::dropped() << '\n';
+
+	metrics::write_header(out, "ik_auth_recv_buffers", "gauge", "Pooled receive blocks held by connections and free for reuse");
+	out << "ik_auth_recv_buffers{state=\"in_use\"} " << buffer_pool::in_use() << '\n';
+	out << "ik_auth_recv_buffers{state=\"pooled\"} " << buffer_pool::pooled() << '\n';
+
+	// Group sizes as a distribution, per gid only when asked for, 200k series are too many by default
+	vector<uint64_t> buckets(metric_buckets::count);
+	uint64_t groups = 0, records = 0;
+	if (config.metrics_group_detail_)
+	{
+		metrics::write_header(out, "ik_auth_group_records", "gauge", "Records of a group");
+	}
+	groups_.for_each([&](unsigned gid, auth_group& group)
+	{
+		size_t size = group.size();
+		buckets[metric_buckets::index(size)]++;
+		groups++;
+		records += size;
+		if (config.metrics_group_detail_)
+			out << "ik_auth_group_records{gid=\"" << gid << "\"} " << size << '\n';
+	});
+	metrics::write_header(out, "ik_auth_groups", "gauge", "Groups in memory");
+	out << "ik_auth_groups " << groups << '\n';
+	metrics::write_header(out, "ik_auth_group_size", "histogram", "Records per group");
+	metrics::write_histogram(out, "ik_auth_group_size", "", &buckets[0], records);
+}
+
+void server::start_reclaim()
+{
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+
+	reclaim_timer_.expires_from_now(std::chrono::seconds(config.group_reclaim_interval_));
+	reclaim_timer_.async_wait(bind(&server::handle_reclaim, this, placeholders::_1));
+}
+
+void server::handle_reclaim(const boost::system::error_code& e)
+{
+	if (e)
+		return;
+
+	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+
+	groups_.reclaim(config.group_reclaim_interval_);
+	AUTH_LOG(debug) << groups_.size() << " groups in memory";
+
+	start_reclaim();
 }
@@ -14,50 +14,107 @@
 #include <boost/asio.hpp>
 #include <string>
 #include <mutex>
+#include <vector>
+#include <memory>
+#include <thread>
 #include "connection.hpp"
-#include "sync_db.hpp"
+#include "auth_group.hpp"
+#include "storage.hpp"
+#include "io_service_pool.hpp"
+#include "expiry_wheel.hpp"
+#include "group_registry.hpp"
+#include "local_store.hpp"
+#include "peer.hpp"
+#include "cluster_ring.hpp"
+#include "metrics_server.hpp"
 class server: private boost::noncopyable
 {
 public:
 	// Construct the server to listen on the specified port,
-	explicit server(const std::size_t port, std::size_t thread_pool_size,sync_db& db);
+	// per_core gives every thread its own io_service and SO_REUSEPORT acceptor
+	explicit server(const std::size_t port, std::size_t thread_pool_size, bool per_core, bool cpu_affinity, storage& db);
 
 	// Run the server's io_service loop.
 	void run();
 
-	sync_db& get_db();
+	storage& get_db();
 
 	auth_group& group(unsigned gid);
 
+	group_registry& groups();
+
+	// Whether this server keeps the gid, always true outside cluster mode.
+	bool owns(unsigned gid) const;
+
+	// The node a client of the gid is redirected to, null when this server owns it.
+	const cluster_node* redirect_of(unsigned gid) const;
+
+	// Persist the records of a group to the storage and the local store,
+	// and push them to the peers unless they came from one.
+	void persist(unsigned gid, const auth_info& auth);
+	void persist(unsigned gid, const std::vector<auth_info>& auths, bool replicate = true);
+
 private:
-	// Initiate an asynchronous accept operation.
-	void start_accept();
+	typedef std::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor_ptr;
+	typedef std::shared_ptr<boost::asio::ip::tcp::socket> socket_ptr;
+
+	// Open an acceptor on the io_service of the given shard.
+	void open_acceptor(std::size_t shard, const boost::asio::ip::tcp::endpoint& endpoint);
+
+	// Initiate an asynchronous accept operation on the given shard.
+	void start_accept(std::size_t shard);
 
 	// Handle completion of an asynchronous accept operation.
-	void handle_accept(const boost::system::error_code& e);
+	void handle_accept(std::size_t shard, const boost::system::error_code& e);
 
 	// Handle a request to stop the server.
 	void handle_stop();
 
-	sync_db& mysql_db_;
+	// Evict the expired records from their groups and the database.
+	void handle_expire(std::vector<expiry_entry>& expired);
+
+	// Hand every group's live records to a local store snapshot.
+	void dump(const local_store::record_sink& sink);
 
-	// The number of threads that will call io_service::run().
-	std::size_t thread_pool_size_;
+	// Prometheus text of the server, its groups and its storage.
+	void collect_metrics(std::ostream& out);
 
-	// The io_service used to perform asynchronous operations.
-	boost::asio::io_service io_service_;
+	// Periodically free the groups nobody uses any more.
+	void start_reclaim();
+	void handle_reclaim(const boost::system::error_code& e);
+
+	storage& db_;
+
+	// The pool of io_service objects used to perform asynchronous operations.
+	io_service_pool io_service_pool_;
 
 	// The signal_set is used to register for process termination notifications.
 	boost::asio::signal_set signals_;
 
-	// Acceptor used to listen for incoming connections.
-	boost::asio::ip::tcp::acceptor acceptor_;
+	// Acceptors used to listen for incoming connections, one per shard.
+	std::vector<acceptor_ptr> acceptors_;
+
+	// The next socket to be accepted, one per shard.
+	std::vector<socket_ptr> sockets_;
+
+	// Expiry wheels, one per shard, a group uses the wheel of gid % shards.
+	std::vector<std::shared_ptr<expiry_wheel> > expiry_wheels_;
+
+	group_registry groups_;
+
+	// Optional journal and snapshot for a fast restart, the storage is then loaded in the background.
+	std::unique_ptr<local_store> local_store_;
+	std::thread reconcile_thread_;
+
+	// The gid ranges of the cluster nodes, in cluster mode.
+	std::unique_ptr<cluster_ring> ring_;
 
-	// The next socket to be accepted.
-	boost::asio::ip::tcp::socket socket_;
+	// Replication to the other servers, when peers are configured.
+	std::unique_ptr<peer_manager> peers_;
 
-	std::map<unsigned, auth_group> memory_db_;
+	// The metrics endpoint, when metrics_port is set.
+	std::unique_ptr<metrics_server> metrics_server_;
 
-	std::mutex mutex_;
+	boost::asio::steady_timer reclaim_timer_;
 };
 #endif // SERVER_HPP
\ No newline at end of file
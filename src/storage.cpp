@@ -0,0 +1,20 @@
+#include "storage.hpp"
+#include "auth_config.hpp"
+#include "sync_db.hpp"
+#include "local_storage.hpp"
+
+using namespace std;
+
+unique_ptr<storage> storage::create(const auth_config& config)
+{
+	switch (config.storage_)
+	{
+	case STORAGE_LOCAL:
+		return unique_ptr<storage>(new local_storage(config.local_store_dir_));
+	case STORAGE_NULL:
+		return unique_ptr<storage>(new null_storage);
+	default:
+		return unique_ptr<storage>(new sync_db(config.db_server_, config.db_user_, config.db_pwd_,
+			config.db_pool_min_, config.db_pool_max_));
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef STORAGE_HPP
+#define STORAGE_HPP
+
+#include <ctime>
+#include <ostream>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <boost/noncopyable.hpp>
+#include "auth_message.hpp"
+#include "local_store.hpp"
+
+class auth_group;
+struct auth_config;
+
+//Where the groups are persisted. Writes may be queued, none of them waits on the storage
+class storage
+	: private boost::noncopyable
+{
+public:
+	typedef local_store::group_lookup group_lookup;
+
+	//The backend the config names: mysql, local or null
+	static std::unique_ptr<storage> create(const auth_config& config);
+
+	virtual ~storage() {}
+
+	//Load the live records into their groups, records already there and newer are kept.
+	//Throws if part of them couldn't be read
+	virtual void load(group_lookup group) = 0;
+
+	//Called once the server serves, dump hands out every live group
+	virtual void start(const local_store::dump_handler& dump) {}
+
+	//Called before the groups go away
+	virtual void stop() {}
+
+	//Insert or replace the records of a group
+	virtual void insert(unsigned gid, const auth_info& auth) = 0;
+	virtual void insert(unsigned gid, const std::vector<auth_info>& auths) = 0;
+
+	//Delete the records of (gid, mac)
+	virtual void erase(const std::vector<std::pair<unsigned, uint64_t> >& records) = 0;
+
+	//Delete every record expired by now
+	virtual void purge(time_t now) = 0;
+
+	//Prometheus text of the backend's queues and latencies
+	virtual void report(std::ostream& out) {}
+};
+
+//Keeps nothing, for edge nodes without a database tier and for benchmarks
+class null_storage
+	: public storage
+{
+public:
+	void load(group_lookup group) override {}
+	void insert(unsigned gid, const auth_info& auth) override {}
+	void insert(unsigned gid, const std::vector<auth_info>& auths) override {}
+	void erase(const std::vector<std::pair<unsigned, uint64_t> >& records) override {}
+	void purge(time_t now) override {}
+};
+
+#endif
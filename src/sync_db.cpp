@@ -3,169 +3,375 @@
 #include <sstream>
 #include <exception>    
 #include <stdio.h>    
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <set>
 #include "sync_db.hpp"
 #include "auth_config.hpp"
-#include <boost/log/trivial.hpp>
+#include "metrics.hpp"
+#include "async_log.hpp"
 
 using namespace std;  
 using namespace sql;  
 
+static const auth_config& db_config()
+{
+	return boost::serialization::singleton<auth_config>::get_const_instance();
+}
 
-sync_db::sync_db(std::string url, std::string user, std::string password, int maxSize)
-	: url_(url), user_(user), password_(password), maxSize_(maxSize), curSize_(0),lock_()
+sync_db::sync_db(std::string url, std::string user, std::string password, int minSize, int maxSize)
+	: pool_(url, user, password, minSize, maxSize, std::chrono::seconds(db_config().db_check_interval_),
+		std::chrono::seconds(db_config().db_idle_timeout_)),
+	writer_(db_config().db_writer_threads_, db_config().db_batch_max_,
+		std::chrono::milliseconds(db_config().db_flush_interval_), db_config().db_queue_max_,
+		std::bind(&sync_db::write, this, std::placeholders::_1))
 {
-	//The sql::SQLException may be thrown out
-	driver_ = sql::mysql::get_driver_instance();
+}
 
-	InitConnection(maxSize / 2 + 1);
+sync_db::~sync_db()
+{
+	//Write what is still queued before the pool goes
+	writer_.stop();
 }
 
-//init conn pool  
-void sync_db::InitConnection(int initSize)
+void sync_db::stop()
 {
-	Connection* conn;
-	lock_guard<mutex> guard(lock_);
+	writer_.stop();
+}
 
-	for (int i = 0; i < initSize; i++)
-	{
-		conn = driver_->connect(url_, user_, password_);  //create a conn  
-		connList_.push_back(conn);
-		++(curSize_);
-	}
+void sync_db::insert(unsigned gid, const auth_info &auth)
+{
+	writer_.replace(gid, auth);
 }
 
-Connection* sync_db::GetConnection()
+void sync_db::insert(unsigned gid, const vector<auth_info>& auths)
 {
-	Connection* conn;
+	writer_.replace(gid, auths);
+}
 
-	lock_guard<mutex> guard(lock_);
+void sync_db::erase(const vector<pair<unsigned, uint64_t> >& records)
+{
+	writer_.erase(records);
+}
+
+const db_writer_stats& sync_db::writer_stats() const
+{
+	return writer_.stats();
+}
 
-	if (connList_.size() > 0)//the pool have a conn   
+const db_pool_stats& sync_db::pool_stats() const
+{
+	return pool_.stats();
+}
+
+void sync_db::report(ostream& out)
+{
+	const db_writer_stats& writer = writer_.stats();
+	struct { const char* name; const char* type; const char* help; uint64_t value; } values[] =
 	{
-		conn = connList_.front();
-		connList_.pop_front();//move the first conn   
-		if (conn->isClosed())//if the conn is closed, delete it and recreate it  
-		{
-			delete conn;
-			conn = driver_->connect(url_, user_, password_);  //create a conn 
-		}
+		{ "ik_auth_db_queue_depth", "gauge", "Writes waiting for the database", writer.queued_ },
+		{ "ik_auth_db_collapsed_total", "counter", "Writes replaced by a later one of the same row", writer.collapsed_ },
+		{ "ik_auth_db_dropped_total", "counter", "Writes refused because the queue was full", writer.dropped_ },
+		{ "ik_auth_db_batches_total", "counter", "Batches written", writer.batches_ },
+		{ "ik_auth_db_rows_total", "counter", "Rows written", writer.rows_ },
+		{ "ik_auth_db_failed_total", "counter", "Rows of failed batches, they are retried", writer.failed_ },
+		{ "ik_auth_db_lost_total", "counter", "Rows still failing when the writer stopped", writer.lost_ },
+		{ "ik_auth_db_max_batch", "gauge", "Largest batch written", writer.max_batch_ },
+		{ "ik_auth_db_write_latency_microseconds", "gauge", "Queue to database latency of the last batch", writer.last_latency_us_ },
+		{ "ik_auth_db_pool_size", "gauge", "Database connections open", pool_.stats().size_ },
+		{ "ik_auth_db_pool_idle", "gauge", "Database connections idle", pool_.stats().idle_ },
+		{ "ik_auth_db_pool_created_total", "counter", "Database connections created", pool_.stats().created_ },
+		{ "ik_auth_db_pool_destroyed_total", "counter", "Database connections closed as broken or idle", pool_.stats().destroyed_ },
+		{ "ik_auth_db_pool_timeouts_total", "counter", "Acquires that gave up waiting", pool_.stats().timeouts_ },
+	};
+	for (auto& v : values)
+	{
+		metrics::write_header(out, v.name, v.type, v.help);
+		out << v.name << ' ' << v.value << '\n';
+	}
 
-		return conn;
+	//The pool keeps its own fixed buckets
+	const db_pool_stats& pool = pool_.stats();
+	metrics::write_header(out, "ik_auth_db_pool_wait_microseconds", "histogram", "Wait for a database connection");
+	uint64_t cumulative = 0;
+	for (size_t i = 0; i < db_pool_stats::wait_buckets; i++)
+	{
+		cumulative += pool.waits_[i];
+		out << "ik_auth_db_pool_wait_microseconds_bucket{le=\"";
+		if (i < db_pool_stats::wait_buckets - 1)
+			out << db_pool_stats::wait_bounds_us[i];
+		else
+			out << "+Inf";
+		out << "\"} " << cumulative << '\n';
 	}
-	else
+	out << "ik_auth_db_pool_wait_microseconds_count " << cumulative << '\n';
+}
+
+//Pad every chunk up to a prepared row count by repeating its last row
+static void replace_rows(db_connection& conn, const vector<const db_op*>& replaces)
+{
+	for (size_t begin = 0; begin < replaces.size();)
 	{
-		if (curSize_ < maxSize_)//the pool no conn  
-		{
-			conn = driver_->connect(url_, user_, password_);  //create a conn
-			++curSize_;
-			return conn;
-		}
-		else //the conn count > maxSize  
+		size_t n = min(db_connection::rows(replaces.size() - begin), replaces.size() - begin);
+		sql::PreparedStatement& stmt = conn.replace(n);
+		for (size_t i = 0, rows = db_connection::rows(n); i < rows; i++)
 		{
-			throw std::logic_error("thread count is more than connections");
+			const db_op& op = *replaces[begin + min(i, n - 1)];
+			stmt.setString(i * 5 + 1, op.auth_.mac_);
+			stmt.setUInt(i * 5 + 2, op.auth_.attr_);
+			stmt.setUInt(i * 5 + 3, op.gid_);
+			stmt.setUInt(i * 5 + 4, op.auth_.auth_time_);
+			stmt.setUInt(i * 5 + 5, op.auth_.duration_);
 		}
+		conn.execute_update(stmt);
+		begin += n;
 	}
 }
 
-//put conn back to pool  
-void sync_db::ReleaseConnection(Connection *conn)
+bool sync_db::write(const vector<db_op>& batch)
 {
-	if (conn)
+	vector<const db_op*> replaces, erases;
+	for (auto& op : batch)
 	{
-		lock_guard<mutex> guard(lock_);
-		connList_.push_back(conn);
+		(op.erase_ ? erases : replaces).push_back(&op);
 	}
+
+	try
+	{
+		db_pool::lease conn = pool_.acquire(std::chrono::milliseconds(db_config().db_acquire_timeout_));
+
+		replace_rows(*conn, replaces);
+
+		for (size_t begin = 0; begin < erases.size();)
+		{
+			size_t n = min(db_connection::rows(erases.size() - begin), erases.size() - begin);
+			sql::PreparedStatement& stmt = conn->erase(n);
+			for (size_t i = 0, rows = db_connection::rows(n); i < rows; i++)
+			{
+				const db_op& op = *erases[begin + min(i, n - 1)];
+				stmt.setUInt(i * 2 + 1, op.gid_);
+				stmt.setString(i * 2 + 2, auth_record::mac_string(op.mac_));
+			}
+			conn->execute_update(stmt);
+			begin += n;
+		}
+	}
+	catch (std::exception& e)
+	{
+		AUTH_LOG(error) << "write " << batch.size() << " records to database error " << e.what();
+		return false;
+	}
+	return true;
 }
 
-void sync_db::DestoryConnPool()
+void sync_db::load(group_lookup group)
 {
-	lock_guard<mutex> guard(lock_);
+	AUTH_LOG(info) << "Load database begin";
+
+	const auth_config& config = db_config();
+	auto start = std::chrono::steady_clock::now();
+	time_t now = time(NULL);
 
-	for (auto iter = connList_.begin(); iter != connList_.end(); ++iter)
+	try
 	{
-		DestoryConnection(*iter);
+		purge(now);
+	}
+	catch (const std::exception&e)
+	{
+		AUTH_LOG(error) << "Purge expired records error:" << e.what();
 	}
-	curSize_ = 0;
-	connList_.clear();
-}
 
+	//Every loader holds a connection while it reads a page
+	unsigned partitions = std::max<unsigned>(std::min<unsigned>(config.db_load_threads_, config.db_pool_max_), 1);
+	std::atomic<size_t> count(0);
+	vector<std::thread> loaders;
+	std::exception_ptr error;
+	std::mutex error_mutex;
 
-void sync_db::DestoryConnection(Connection* conn)
-{
-	if (conn)
+	for (unsigned i = 0; i < partitions; i++)
 	{
-		try 
-		{
-			conn->close();
-		}
-		catch (std::exception& e)
+		loaders.emplace_back([this, i, partitions, now, &group, &count, &error, &error_mutex]()
 		{
-			cerr << e.what() << endl;
-		}
-		delete conn;
+			try
+			{
+				count += load_partition(i, partitions, now, group);
+			}
+			catch (const std::exception&e)
+			{
+				AUTH_LOG(error) << "Load database partition " << i << " error:" << e.what();
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if (!error)
+					error = std::current_exception();
+			}
+		});
 	}
+	for (auto& loader : loaders)
+		loader.join();
+
+	//A partition missing its records must not be served as if it were complete
+	if (error)
+		std::rethrow_exception(error);
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+	AUTH_LOG(info) << "Load " << count << " record from database in " << elapsed.count() << "ms";
 }
 
-sync_db::~sync_db()
+//The records a group kept from legacy rows are written again under the canonical mac
+void sync_db::migrate(unsigned gid, const vector<auth_info>& stored, const set<pair<unsigned, uint64_t> >& legacy,
+	vector<db_op>& rewrite)
 {
-	DestoryConnPool();
+	auto now = std::chrono::steady_clock::now();
+	for (auto& auth : stored)
+	{
+		uint64_t mac = auth_message::mac_key(auth.mac_);
+		if (legacy.count(make_pair(gid, mac)))
+			rewrite.push_back(db_op{ gid, mac & mac_mask, false, auth, now });
+	}
 }
 
-void sync_db::insert(unsigned gid, const auth_info &auth)
+void sync_db::migrate_legacy(const vector<pair<unsigned, string> >& legacy, const vector<db_op>& rewrite)
 {
-	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+	db_pool::lease conn = pool_.acquire(std::chrono::milliseconds(db_config().db_acquire_timeout_));
+	conn->begin();
 	try
 	{
-		Connection *conn = GetConnection();
-		conn->setSchema(config.db_database_);
-		shared_ptr<Statement> stmt(conn->createStatement());
-		std::ostringstream os;
-		os << "replace into " << config.db_table_
-			<< " (mac,attr,gid,auth_time,duration) values (" << "\'" << auth.mac_ << "\'," << auth.attr_ << ',' << gid << "," << auth.auth_time_ << "," << auth.duration_ << ")";
-		stmt->executeUpdate(os.str());
-		ReleaseConnection(conn);
+		//A case insensitive collation makes a lowercase legacy mac equal to its canonical one,
+		//the delete goes first so it can't take the rewritten row with it
+		for (size_t begin = 0; begin < legacy.size();)
+		{
+			size_t n = min(db_connection::rows(legacy.size() - begin), legacy.size() - begin);
+			sql::PreparedStatement& stmt = conn->erase(n);
+			for (size_t i = 0, rows = db_connection::rows(n); i < rows; i++)
+			{
+				const pair<unsigned, string>& row = legacy[begin + min(i, n - 1)];
+				stmt.setUInt(i * 2 + 1, row.first);
+				stmt.setString(i * 2 + 2, row.second);
+			}
+			conn->execute_update(stmt);
+			begin += n;
+		}
+
+		vector<const db_op*> replaces;
+		for (auto& op : rewrite)
+			replaces.push_back(&op);
+		replace_rows(*conn, replaces);
+		conn->commit();
 	}
-	catch (std::exception& e)
+	catch (std::exception&)
 	{
-		BOOST_LOG_TRIVIAL(error) << "insert into database error " << e.what();
+		//Closing the connection rolls the transaction back
+		conn.invalidate();
+		throw;
 	}
+	AUTH_LOG(info) << "Migrate " << legacy.size() << " rows to canonical macs";
 }
 
-void sync_db::load_auth_info(std::map<unsigned, auth_group>& memory_db)
+void sync_db::purge(time_t now)
 {
-	BOOST_LOG_TRIVIAL(info) << "Load database begin";
+	const uint32_t batch = std::max<uint32_t>(db_config().db_purge_batch_, 1);
+	size_t purged = 0;
 
-	const auth_config& config = boost::serialization::singleton<auth_config>::get_const_instance();
+	for (;;)
+	{
+		db_pool::lease conn = pool_.acquire(std::chrono::milliseconds(db_config().db_acquire_timeout_));
+		sql::PreparedStatement& stmt = conn->purge();
+		stmt.setUInt64(1, now);
+		stmt.setUInt(2, batch);
 
-	try
+		int deleted = conn->execute_update(stmt);
+		purged += deleted;
+		if (deleted < (int)batch)
+			break;
+	}
+
+	AUTH_LOG(info) << "Purge " << purged << " expired record from database";
+}
+
+size_t sync_db::load_partition(unsigned partition, unsigned partitions, time_t now,
+	const group_lookup& group)
+{
+	const uint32_t page = std::max<uint32_t>(db_config().db_load_page_, 1);
+	unsigned last_gid = 0;
+	string last_mac;
+	size_t count = 0;
+
+	//Keyset pagination on (gid, mac), so memory stays at one page per loader
+	for (;;)
 	{
-		unsigned count = 0;
-		Connection *conn = GetConnection();
-		conn->setSchema(config.db_database_);
-		shared_ptr<Statement> stmt1(conn->createStatement());
-		shared_ptr<Statement> stmt2(conn->createStatement());
-		shared_ptr<ResultSet> res(stmt1->executeQuery("select * from  " + config.db_table_));
-
-		while (res->next())
+		vector<pair<unsigned, auth_info> > rows;
+		//Rows whose mac isn't "AA:BB:CC:DD:EE:FF": (gid, mac as stored)
+		vector<pair<unsigned, string> > legacy;
+		set<pair<unsigned, uint64_t> > legacy_keys;
 		{
-			auth_info auth;
-			auth.mac_= res->getString("mac");
-			auth.attr_ = res->getUInt("attr");
-			auth.auth_time_ = res->getUInt("auth_time");
-			auth.duration_ = res->getUInt("duration");
-			if (time(NULL) - auth.auth_time_ >= auth.duration_)
+			db_pool::lease conn = pool_.acquire(std::chrono::milliseconds(db_config().db_acquire_timeout_));
+			sql::PreparedStatement& stmt = conn->load();
+			stmt.setUInt(1, partitions);
+			stmt.setUInt(2, partition);
+			stmt.setUInt(3, last_gid);
+			stmt.setUInt(4, last_gid);
+			stmt.setString(5, last_mac);
+			stmt.setUInt64(6, now);
+			stmt.setUInt(7, page);
+
+			shared_ptr<ResultSet> res(conn->execute_query(stmt));
+			rows.reserve(page);
+			while (res->next())
 			{
-				stmt2->executeUpdate("delete from " + config.db_table_ + " where mac = \'" + auth.mac_ + "\' and gid = " + std::to_string(res->getUInt("gid")));
+				auth_info auth;
+				auth.mac_ = res->getString("mac");
+				auth.attr_ = res->getUInt("attr");
+				auth.auth_time_ = res->getUInt("auth_time");
+				auth.duration_ = res->getUInt("duration");
+				auth.res1_ = 0;
+				auth.res2_ = 0;
+				rows.push_back(make_pair(res->getUInt("gid"), auth));
+			}
+		}
+		if (rows.empty())
+			break;
+
+		//The cursor is the mac as stored
+		last_gid = rows.back().first;
+		last_mac = rows.back().second.mac_;
+		count += rows.size();
+
+		//Clients' macs are kept as "AA:BB:CC:DD:EE:FF", the rows of an older format are
+		//canonicalized so their re-auths and deletes hit the same row
+		for (auto& row : rows)
+		{
+			uint8_t mac[6];
+			if (!auth_message::mac_to_bytes(row.second.mac_, mac))
 				continue;
+			string canonical = auth_message::bytes_to_mac(mac);
+			if (canonical != row.second.mac_)
+			{
+				legacy.push_back(make_pair(row.first, row.second.mac_));
+				legacy_keys.insert(make_pair(row.first, auth_message::mac_key(canonical)));
+				row.second.mac_ = canonical;
 			}
-			memory_db[res->getUInt("gid")].insert(auth);
-			count++;
 		}
-		ReleaseConnection(conn);
-		BOOST_LOG_TRIVIAL(info) << "Load "<< count << " record from database";
-	}
-	catch (const std::exception&e)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "Load database error:" << e.what();
+
+		//Rows come ordered by gid, hand every group its run at once
+		vector<auth_info> auths;
+		vector<db_op> rewrite;
+		for (size_t begin = 0, end; begin < rows.size(); begin = end)
+		{
+			auths.clear();
+			for (end = begin; end < rows.size() && rows[end].first == rows[begin].first; end++)
+				auths.push_back(rows[end].second);
+			auth_group* g = group(rows[begin].first);
+			while (g && !g->merge(auths))
+				g = group(rows[begin].first);
+			if (g && !legacy_keys.empty())
+				migrate(rows[begin].first, auths, legacy_keys, rewrite);
+		}
+		if (!legacy.empty())
+			migrate_legacy(legacy, rewrite);
+
+		if (rows.size() < page)
+			break;
 	}
+	return count;
 }
@@ -5,7 +5,11 @@
 #include <string>
 #include <mutex>
 #include <map>
+#include <set>
 #include <list>
+#include <vector>
+#include <functional>
+#include <ctime>
 #include <mysql_connection.h>    
 #include <mysql_driver.h>    
 #include <cppconn/exception.h>    
@@ -16,47 +20,59 @@
 #include <cppconn/statement.h>      
 #include <boost/noncopyable.hpp>
 #include "auth_group.hpp"
+#include "db_writer.hpp"
+#include "db_pool.hpp"
+#include "storage.hpp"
  
-class sync_db:boost::noncopyable
+//The MySQL storage
+class sync_db:public storage
 {
 public:
 	//Constructor 
-	sync_db(std::string url, std::string user, std::string password, int maxSize);
+	sync_db(std::string url, std::string user, std::string password, int minSize, int maxSize);
 
-	//get a conn from pool  
-	sql::Connection* GetConnection();
+	//Purge the expired rows, then load the live ones in parallel
+	void load(group_lookup group) override;
 
-	//put the conn back to pool  
-	void ReleaseConnection(sql::Connection *conn);
+	//Write what is queued
+	void stop() override;
 
-	void load_auth_info(std::map<unsigned, auth_group>& memory_db);
+	//Queue the records for the write-behind workers, never waits on the database
+	void insert(unsigned gid, const auth_info &auth) override;
+	void insert(unsigned gid, const std::vector<auth_info>& auths) override;
 
-	void insert(unsigned gid, const auth_info &auth);
+	//Queue the deletes of (gid, mac)
+	void erase(const std::vector<std::pair<unsigned, uint64_t> >& records) override;
 
-	~sync_db();
+	//Delete the expired rows, db_purge_batch rows a statement
+	void purge(time_t now) override;
 
-private:
-	//init DB pool  
-	void InitConnection(int initSize);
+	const db_writer_stats& writer_stats() const;
+	const db_pool_stats& pool_stats() const;
 
-	//destory connection  
-	void DestoryConnection(sql::Connection *conn);
+	void report(std::ostream& out) override;
 
-	//destory db pool  
-	void DestoryConnPool();
+	~sync_db() override;
 
 private:
-	std::string url_;
-	std::string user_;
-	std::string password_;
-	int maxSize_;
-	int curSize_;
+	//Write a batch of the writer with the prepared replace and delete statements, on a writer thread
+	bool write(const std::vector<db_op>& batch);
+
+	//Page through the live rows of the gids where gid % partitions == partition, returns the row count
+	std::size_t load_partition(unsigned partition, unsigned partitions, time_t now,
+		const group_lookup& group);
 
-	sql::Driver* driver_;     //sql driver (the sql will free it)  
-	std::list<sql::Connection*> connList_;   //create conn list  
+	//Legacy format rows: the records a group kept from them are added to rewrite under the
+	//canonical mac. migrate_legacy deletes the rows as stored and writes rewrite in one
+	//transaction, the delete can't meet a canonical row that compares equal to a legacy one
+	void migrate(unsigned gid, const std::vector<auth_info>& stored,
+		const std::set<std::pair<unsigned, uint64_t> >& legacy, std::vector<db_op>& rewrite);
+	void migrate_legacy(const std::vector<std::pair<unsigned, std::string> >& legacy,
+		const std::vector<db_op>& rewrite);
 
+private:
+	db_pool pool_;
 
-	//thread lock mutex  
-	std::mutex lock_;
+	db_writer writer_;
 };
-#endif  
\ No newline at end of file
+#endif  